@@ -12,6 +12,9 @@ def process(events):
   wss_events = defaultdict(dict)
   udp_events = defaultdict(dict)
   for evt in events:
+    # Depth updates and tickers carry an event type, trades do not.
+    if 'e' in evt:
+      continue
     market = evt['s']
     if evt['source'] == 'wss':
       assert evt['t'] not in wss_events[market]
@@ -20,7 +23,11 @@ def process(events):
       assert evt['t'] not in udp_events[market]
       udp_events[market][evt['t']] = evt
 
-  tkey = 'epochNanos'
+  # Kernel receive times, when the receiver recorded them, leave out its own
+  # parsing and queueing delay.
+  all_events = [e for evts in list(wss_events.values()) + list(udp_events.values())
+                for e in evts.values()]
+  tkey = 'rxNanos' if all(e.get('rxNanos') for e in all_events) else 'epochNanos'
   diffs = defaultdict(OrderedDict)
   for market, wss_evts in wss_events.items():
     for tid, wss_evt in wss_evts.items():
@@ -51,9 +58,32 @@ def process(events):
 
   print('Positive indicates a time lead/advantage')
   pprint(results)
+  print_udp_hops(udp_events)
   plt.show()
 
 
+def print_udp_hops(udp_events):
+  """Median time each UDP trade spent on every hop, in ms.
+
+  senderRxNanos and senderTxNanos are already on the receiver's clock; the
+  exchange's trade time T is on its own (in ms), so the first hop also
+  includes whatever our clocks are off from the exchange's.
+  """
+  hops = defaultdict(lambda: defaultdict(list))
+  for market, evts in udp_events.items():
+    for evt in evts.values():
+      if not evt.get('senderTxNanos') or not evt.get('rxNanos'):
+        continue
+      hops[market]['exchange->sender'].append(
+          evt['senderRxNanos'] / 1e6 - evt['T'])
+      hops[market]['sender'].append(
+          (evt['senderTxNanos'] - evt['senderRxNanos']) / 1e6)
+      hops[market]['sender->receiver'].append(
+          (evt['rxNanos'] - evt['senderTxNanos']) / 1e6)
+  pprint({market: {hop: np.median(v) for hop, v in market_hops.items()}
+          for market, market_hops in hops.items()})
+
+
 def loads_or_skip(l):
   try:
     return loads(l)
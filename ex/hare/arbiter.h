@@ -0,0 +1,253 @@
+#ifndef _OPENTOKEN__HARE__ARBITER_H_
+#define _OPENTOKEN__HARE__ARBITER_H_
+
+#include "binance.h"
+#include "check.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace opentoken {
+
+// Merges redundant copies of the same market data feed (UDP senders in
+// several locations, local WSS connections) by keeping the first arrival of
+// each trade, depth update, book ticker and ticker and dropping the rest.
+// They are told apart by market and trade id, final update id and part,
+// update id or event time.
+//
+// Recently seen records live in an open addressing table with linear
+// probing. An entry expires once |window| newer records have been inserted,
+// so the table never needs explicit deletes: probes skip expired slots and
+// insertion reuses them.
+class TradeArbiter final {
+ public:
+  explicit TradeArbiter(size_t window) : window_(window) {
+    CHECK(window > 0);
+    size_t capacity = 1;
+    while (capacity < 2 * window) {
+      capacity *= 2;
+    }
+    slots_.resize(capacity);
+    mask_ = capacity - 1;
+  }
+
+  size_t add_source(const std::string& name) {
+    sources_.push_back(SourceStats{name});
+    return sources_.size() - 1;
+  }
+
+  // Returns true if this is the first copy of |trade| from any source.
+  bool arrive(const BinanceTrade& trade, size_t source, uint64_t now_nanos) {
+    return arrive(make_key(Kind::Trade, trade.market, trade.trade_id), source,
+                  now_nanos);
+  }
+
+  bool arrive(const BinanceDepthUpdate& update, size_t source,
+              uint64_t now_nanos) {
+    return arrive(make_key(Kind::DepthUpdate, update.market,
+                           update.final_update_id, update.part),
+                  source, now_nanos);
+  }
+
+  bool arrive(const BinanceBookTicker& ticker, size_t source,
+              uint64_t now_nanos) {
+    return arrive(make_key(Kind::BookTicker, ticker.market, ticker.update_id),
+                  source, now_nanos);
+  }
+
+  bool arrive(const BinanceTicker& ticker, size_t source,
+              uint64_t now_nanos) {
+    return arrive(make_key(Kind::Ticker, ticker.market, ticker.event_time),
+                  source, now_nanos);
+  }
+
+  // Returns true if a copy of |record|, a BinanceTrade, BinanceDepthUpdate,
+  // BinanceBookTicker or BinanceTicker, arrived already, without recording
+  // this one.
+  bool seen(const BinanceTrade& trade) const {
+    return find(make_key(Kind::Trade, trade.market, trade.trade_id));
+  }
+
+  bool seen(const BinanceDepthUpdate& update) const {
+    return find(make_key(Kind::DepthUpdate, update.market,
+                         update.final_update_id, update.part));
+  }
+
+  bool seen(const BinanceBookTicker& ticker) const {
+    return find(make_key(Kind::BookTicker, ticker.market, ticker.update_id));
+  }
+
+  bool seen(const BinanceTicker& ticker) const {
+    return find(make_key(Kind::Ticker, ticker.market, ticker.event_time));
+  }
+
+  const std::string& source_name(size_t source) const {
+    return sources_[source].name;
+  }
+
+  // Writes per source win counts and lead times since the last report.
+  void report(FILE* f) {
+    for (auto& stats : sources_) {
+      fprintf(f,
+              "%s: won %llu, duplicate %llu, mean lead %.1fus, max lead "
+              "%.1fus\n",
+              stats.name.c_str(), static_cast<unsigned long long>(stats.wins),
+              static_cast<unsigned long long>(stats.duplicates),
+              stats.leads ? 1e-3 * static_cast<double>(stats.lead_sum_nanos) /
+                                static_cast<double>(stats.leads)
+                          : 0.0,
+              1e-3 * static_cast<double>(stats.lead_max_nanos));
+      stats = SourceStats{stats.name};
+    }
+  }
+
+ private:
+  TradeArbiter(TradeArbiter&) = delete;
+  TradeArbiter(TradeArbiter&&) = delete;
+
+  constexpr static size_t kMaxProbe = 32;
+
+  enum class Kind : uint8_t {
+    Trade,
+    DepthUpdate,
+    BookTicker,
+    Ticker,
+  };
+
+  struct Key {
+    char market[sizeof(BinanceTrade::market)];
+    uint64_t id;
+    Kind kind;
+    uint16_t part;
+
+    bool operator==(const Key& other) const {
+      return id == other.id && kind == other.kind && part == other.part &&
+             std::memcmp(market, other.market, sizeof(market)) == 0;
+    }
+  };
+
+  struct Entry {
+    Key key;
+    uint64_t serial;  // 0 if never used
+    uint64_t arrival_nanos;
+    uint32_t source;
+    bool lead_recorded;
+  };
+
+  struct SourceStats {
+    std::string name;
+    uint64_t wins = 0;
+    uint64_t duplicates = 0;
+    // Time by which this source's copy arrived before the runner up.
+    uint64_t leads = 0;
+    uint64_t lead_sum_nanos = 0;
+    uint64_t lead_max_nanos = 0;
+  };
+
+  // Takes the record's market by reference so that a longer one than the
+  // key holds cannot be cut short and merge with another.
+  static Key make_key(Kind kind, const char (&market)[sizeof(Key::market)],
+                      uint64_t id, uint16_t part = 0) {
+    Key key{};
+    std::memcpy(key.market, market, strnlen(market, sizeof(key.market)));
+    key.id = id;
+    key.kind = kind;
+    key.part = part;
+    return key;
+  }
+
+  // Returns true if |key| is in the table and live.
+  bool find(const Key& key) const {
+    const uint64_t hash = hash_key(key);
+    for (size_t probe = 0; probe < kMaxProbe; ++probe) {
+      const Entry& entry = slots_[(hash + probe) & mask_];
+      if (entry.serial == 0) {
+        return false;
+      }
+      if (is_live(entry) && entry.key == key) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool arrive(const Key& key, size_t source, uint64_t now_nanos) {
+    CHECK(source < sources_.size());
+
+    const uint64_t hash = hash_key(key);
+    Entry* reusable = nullptr;
+    Entry* oldest = nullptr;
+    for (size_t probe = 0; probe < kMaxProbe; ++probe) {
+      Entry& entry = slots_[(hash + probe) & mask_];
+      if (entry.serial == 0 || !is_live(entry)) {
+        if (!reusable) {
+          reusable = &entry;
+        }
+        if (entry.serial == 0) {
+          break;
+        }
+        continue;
+      }
+      if (entry.key == key) {
+        record_duplicate(&entry, source, now_nanos);
+        return false;
+      }
+      if (!oldest || entry.serial < oldest->serial) {
+        oldest = &entry;
+      }
+    }
+
+    // Every slot in the probe range is live: give up the oldest one early.
+    Entry* const slot = reusable ? reusable : oldest;
+    *slot = Entry{key, ++serial_, now_nanos, static_cast<uint32_t>(source),
+                  false};
+    ++sources_[source].wins;
+    return true;
+  }
+
+  static uint64_t hash_key(const Key& key) {
+    uint64_t words[2];
+    std::memcpy(words, key.market, sizeof(words));
+    uint64_t h = (key.id ^ static_cast<uint64_t>(key.kind) << 56 ^
+                  static_cast<uint64_t>(key.part) << 40) *
+                 0x9E3779B97F4A7C15ULL;
+    h ^= words[0] + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+    h ^= words[1] + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+    return h ^ (h >> 29);
+  }
+
+  bool is_live(const Entry& entry) const {
+    return serial_ - entry.serial < window_;
+  }
+
+  void record_duplicate(Entry* entry, size_t source, uint64_t now_nanos) {
+    ++sources_[source].duplicates;
+    if (entry->lead_recorded || entry->source == source) {
+      return;
+    }
+    entry->lead_recorded = true;
+    // Arrival times can come from the kernel, so the copy we saw second may
+    // still have arrived first. Credit the lead to whichever did.
+    const bool entry_first = entry->arrival_nanos <= now_nanos;
+    auto& leader = sources_[entry_first ? entry->source : source];
+    const uint64_t lead = entry_first ? now_nanos - entry->arrival_nanos
+                                      : entry->arrival_nanos - now_nanos;
+    ++leader.leads;
+    leader.lead_sum_nanos += lead;
+    leader.lead_max_nanos = std::max(leader.lead_max_nanos, lead);
+  }
+
+  const size_t window_;
+  std::vector<Entry> slots_;
+  size_t mask_;
+  uint64_t serial_ = 0;
+  std::vector<SourceStats> sources_;
+};
+
+}  // namespace opentoken
+
+#endif  // _OPENTOKEN__HARE__ARBITER_H_
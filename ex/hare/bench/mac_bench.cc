@@ -0,0 +1,258 @@
+#include "binance.h"
+#include "check.h"
+#include "hasher.h"
+#include "protocol.h"
+#include "timing.h"
+
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace opentoken {
+namespace {
+using namespace std;
+
+string to_hex(const uint8_t* data, size_t size) {
+  constexpr auto hex = "0123456789abcdef";
+  string result;
+  for (size_t i = 0; i < size; ++i) {
+    result += hex[data[i] >> 4];
+    result += hex[data[i] & 0xf];
+  }
+  return result;
+}
+
+// Checks the backends against published test vectors: SipHash-2-4-128 from
+// the reference implementation, keyed BLAKE2s from Python's hashlib, both
+// with keys 00 01 02 ... and messages 00 01 02 ...
+void check_test_vectors() {
+  uint8_t bytes[256];
+  for (size_t i = 0; i < sizeof(bytes); ++i) {
+    bytes[i] = static_cast<uint8_t>(i);
+  }
+  uint8_t tag[32];
+
+  SipHash128Mac siphash{bytes};
+  const pair<size_t, const char*> siphash_vectors[] = {
+      {0, "a3817f04ba25a8e66df67214c7550293"},
+      {1, "da87c1d86b99af44347659119b22fc45"},
+      {15, "5493e99933b0a8117e08ec0f97cfc3d9"},
+  };
+  for (const auto& vector : siphash_vectors) {
+    siphash.mac(bytes, vector.first, tag);
+    CHECK(to_hex(tag, SipHash128Mac::kTagSize) == vector.second,
+          "siphash of %zu bytes is %s", vector.first,
+          to_hex(tag, SipHash128Mac::kTagSize).c_str());
+  }
+
+  Blake2sMac blake2s{bytes};
+  const pair<size_t, const char*> blake2s_vectors[] = {
+      {0, "48a8997da407876b3d79c0d92325ad3b89cbb754d86ab71aee047ad345fd2c49"},
+      {3, "1d220dbe2ee134661fdf6d9e74b41704710556f2f6e5a091b227697445dbea6b"},
+      {64, "8975b0577fd35566d750b362b0897a26c399136df07bababbde6203ff2954ed4"},
+      {65, "21fe0ceb0052be7fb0f004187cacd7de67fa6eb0938d927677f2398c132317a8"},
+      {200,
+       "13c88480a5d00d6c8c7ad2110d76a82d9b70f4fa6696d4e5dd42a066dcaf9920"},
+  };
+  for (const auto& vector : blake2s_vectors) {
+    blake2s.mac(bytes, vector.first, tag);
+    CHECK(to_hex(tag, Blake2sMac::kTagSize) == vector.second,
+          "blake2s of %zu bytes is %s", vector.first,
+          to_hex(tag, Blake2sMac::kTagSize).c_str());
+  }
+}
+
+// Checks HmacSha256Batch with |impl|, one at a time and in batches of
+// every size, against OpenSSL for keys and messages around the block size.
+void check_hmac_batch(HmacSha256Batch::Impl impl) {
+  vector<uint8_t> bytes(2000);
+  for (size_t i = 0; i < bytes.size(); ++i) {
+    bytes[i] = static_cast<uint8_t>(i * 7 + 3);
+  }
+  const size_t message_sizes[] = {0,  1,   8,   48,  55,  56,   63,
+                                  64, 65,  88,  119, 120, 128,  200,
+                                  500, 1000, 1440, 1472};
+  for (const size_t key_size : {1, 32, 64, 65, 100}) {
+    const string key(reinterpret_cast<const char*>(bytes.data()) + 1000,
+                     key_size);
+    HmacSha256Mac openssl{key};
+    HmacSha256Batch batch{reinterpret_cast<const uint8_t*>(key.data()),
+                          key.size(), impl};
+    const uint8_t* inputs[HmacSha256Batch::kLanes];
+    size_t sizes[HmacSha256Batch::kLanes];
+    uint8_t tags[HmacSha256Batch::kLanes][32];
+    uint8_t* tag_ptrs[HmacSha256Batch::kLanes];
+    for (size_t count = 1; count <= HmacSha256Batch::kLanes; ++count) {
+      for (size_t first = 0; first < size(message_sizes); ++first) {
+        for (size_t i = 0; i < count; ++i) {
+          inputs[i] = bytes.data() + i;
+          sizes[i] = message_sizes[(first + i * 5) % size(message_sizes)];
+          tag_ptrs[i] = tags[i];
+        }
+        batch.mac_batch(inputs, sizes, count, tag_ptrs);
+        for (size_t i = 0; i < count; ++i) {
+          uint8_t expected[32];
+          openssl.mac(inputs[i], sizes[i], expected);
+          CHECK(memcmp(tags[i], expected, sizeof(expected)) == 0,
+                "%s hmac of %zu bytes with a %zu byte key in a batch of %zu",
+                HmacSha256Batch::impl_name(impl), sizes[i], key_size, count);
+          batch.mac(inputs[i], sizes[i], tags[i]);
+          CHECK(memcmp(tags[i], expected, sizeof(expected)) == 0,
+                "%s hmac of %zu bytes with a %zu byte key",
+                HmacSha256Batch::impl_name(impl), sizes[i], key_size);
+        }
+      }
+    }
+  }
+}
+
+// Time per signature and per verification of |size| byte messages.
+void bench(MacAlgorithm algorithm, size_t size, size_t iterations) {
+  Hasher hasher{"benchmark key", algorithm};
+  vector<uint8_t> message(size + kHashSizeBytes);
+  for (size_t i = 0; i < size; ++i) {
+    message[i] = static_cast<uint8_t>(i * 31);
+  }
+
+  uint64_t start = nanos_monotonic();
+  for (size_t i = 0; i < iterations; ++i) {
+    // Vary the input so that nothing is hoisted out of the loop.
+    message[0] = static_cast<uint8_t>(i);
+    hasher.hash(message.data(), size, message.data() + size);
+  }
+  const uint64_t sign_nanos = nanos_monotonic() - start;
+
+  size_t valid = 0;
+  start = nanos_monotonic();
+  for (size_t i = 0; i < iterations; ++i) {
+    valid += hasher.is_valid_signature(message.data(), size,
+                                       message.data() + size);
+  }
+  const uint64_t verify_nanos = nanos_monotonic() - start;
+  CHECK(valid == iterations);
+
+  printf("%-12s %5zu bytes: sign %7.1f ns/message, verify %7.1f ns/message\n",
+         mac_algorithm_name(algorithm), size,
+         static_cast<double>(sign_nanos) / static_cast<double>(iterations),
+         static_cast<double>(verify_nanos) / static_cast<double>(iterations));
+}
+
+// Time per signature of |size| byte messages |count| at a time with
+// hash_batch().
+void bench_batch(MacAlgorithm algorithm, size_t size, size_t count,
+                 size_t iterations) {
+  Hasher hasher{"benchmark key", algorithm};
+  vector<vector<uint8_t>> messages(count, vector<uint8_t>(size + 1));
+  vector<const uint8_t*> inputs(count);
+  vector<size_t> sizes(count, size);
+  vector<array<uint8_t, kHashSizeBytes>> tags(count);
+  vector<uint8_t*> outputs(count);
+  for (size_t i = 0; i < count; ++i) {
+    for (size_t j = 0; j < size; ++j) {
+      messages[i][j] = static_cast<uint8_t>(i + j * 31);
+    }
+    inputs[i] = messages[i].data();
+    outputs[i] = tags[i].data();
+  }
+
+  const size_t batches = iterations / count;
+  const uint64_t start = nanos_monotonic();
+  for (size_t i = 0; i < batches; ++i) {
+    messages[0][0] = static_cast<uint8_t>(i);
+    hasher.hash_batch(inputs.data(), sizes.data(), count, outputs.data());
+  }
+  const uint64_t nanos = nanos_monotonic() - start;
+  printf("%-12s %5zu bytes: batches of %zu, %7.1f ns/message\n",
+         mac_algorithm_name(algorithm), size, count,
+         static_cast<double>(nanos) / static_cast<double>(batches * count));
+}
+
+// Time per hash(id) for consecutive ids, computed on the spot or looked up
+// in a cache of |window| signatures. Between ids the thread yields, as the
+// sender would while waiting for the next message, which gives the cache
+// time to refill.
+void bench_ids(MacAlgorithm algorithm, size_t window, size_t iterations) {
+  Hasher hasher{"benchmark key", algorithm};
+  Hasher cached{"benchmark key", algorithm};
+  if (window > 0) {
+    cached.enable_id_cache(window);
+  }
+  uint8_t expected[kHashSizeBytes];
+  uint8_t tag[kHashSizeBytes];
+  for (uint64_t id = 0; id < 100; ++id) {
+    hasher.hash(id, expected);
+    cached.hash(id, tag);
+    CHECK(memcmp(expected, tag, kHashSizeBytes) == 0, "id %llu",
+          static_cast<unsigned long long>(id));
+  }
+  // Let the window fill before timing.
+  cached.hash(uint64_t{100}, tag);
+  this_thread::sleep_for(chrono::milliseconds(10));
+  const IdSignatureCache* cache = cached.id_cache();
+  const uint64_t hits = cache ? cache->hits() : 0;
+  const uint64_t misses = cache ? cache->misses() : 0;
+
+  uint64_t nanos = 0;
+  for (uint64_t id = 101; id < iterations + 101; ++id) {
+    const uint64_t start = nanos_monotonic();
+    cached.hash(id, tag);
+    nanos += nanos_monotonic() - start;
+    this_thread::yield();
+  }
+
+  printf("%-12s ids, window %5zu: %7.1f ns/id", mac_algorithm_name(algorithm),
+         window, static_cast<double>(nanos) / static_cast<double>(iterations));
+  if (cache) {
+    printf(", %llu hits, %llu misses",
+           static_cast<unsigned long long>(cache->hits() - hits),
+           static_cast<unsigned long long>(cache->misses() - misses));
+  }
+  printf("\n");
+}
+
+}  // namespace
+}  // namespace opentoken
+
+int main(int argc, const char** argv) {
+  using namespace opentoken;
+  const size_t iterations = argc < 2 ? 1000000 : std::stoul(argv[1]);
+  check_test_vectors();
+  // Every implementation up to the best one this CPU runs.
+  const auto best = HmacSha256Batch::best_impl();
+  for (const auto impl :
+       {HmacSha256Batch::Impl::Portable, HmacSha256Batch::Impl::Avx2,
+        HmacSha256Batch::Impl::ShaNi}) {
+    if (impl <= best) {
+      check_hmac_batch(impl);
+    }
+  }
+  printf("hmac-sha256 batches: %s\n", HmacSha256Batch::impl_name(best));
+
+  // One trade, a packet of one raw trade, and a full packet.
+  const size_t sizes[] = {
+      sizeof(BinanceTrade),
+      packet_size(PacketType::Trades, 1) - kHashSizeBytes,
+      kDefaultMaxPacketSize - kHashSizeBytes,
+  };
+  for (const auto algorithm : kMacAlgorithms) {
+    for (const size_t size : sizes) {
+      bench(algorithm, size, iterations);
+    }
+  }
+  for (const auto algorithm : kMacAlgorithms) {
+    for (const size_t size : sizes) {
+      for (const size_t count : {1, 4, 8, 16}) {
+        bench_batch(algorithm, size, count, iterations);
+      }
+    }
+  }
+  for (const auto algorithm : kMacAlgorithms) {
+    for (const size_t window : {0, 64, 4096}) {
+      bench_ids(algorithm, window, iterations);
+    }
+  }
+}
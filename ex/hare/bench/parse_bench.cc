@@ -0,0 +1,208 @@
+#include "binance.h"
+#include "check.h"
+#include "decimal.h"
+#include "timing.h"
+
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace opentoken {
+namespace {
+using namespace std;
+
+bool same_trade(const BinanceTrade& a, const BinanceTrade& b) {
+  return a.price == b.price && a.quantity == b.quantity &&
+         a.trade_id == b.trade_id && a.trade_time == b.trade_time &&
+         memcmp(a.market, b.market, sizeof(a.market)) == 0;
+}
+
+// The trade gason reads from |value|, if it is one.
+optional<BinanceTrade> gason_trade(const gason::JsonValue& value) {
+  if (value.getTag() != gason::JsonTag::JSON_OBJECT) {
+    return {};
+  }
+  for (auto pair : value) {
+    if (str_eq("e", pair->key)) {
+      if (pair->value.getTag() == gason::JsonTag::JSON_STRING &&
+          str_eq("trade", pair->value.toString())) {
+        return json_to_binance_trade(value);
+      }
+      break;
+    }
+  }
+  return {};
+}
+
+// Time per line of |lines| through gason and through BinanceTradeParser,
+// after checking that both read the same trades. Both get each line the
+// way uWS hands over a frame: in place in its receive buffer, followed by
+// the next frame's header and payload rather than a terminator.
+void bench(const vector<string>& lines, size_t repeats) {
+  gason::JsonAllocator allocator;
+  gason::JsonValue value;
+  BinanceTradeParser parser;
+  vector<char> frames;
+  const auto load_frame = [&frames](const string& line) {
+    frames.assign(line.begin(), line.end());
+    frames.push_back('\x81');
+    frames.push_back('\x7e');
+    frames.insert(frames.end(), line.begin(), line.end());
+    // Only so that a parser that runs on cannot run off the buffer.
+    frames.push_back('\0');
+    return frames.data();
+  };
+
+  size_t num_trades = 0;
+  for (const auto& line : lines) {
+    char* endptr;
+    const auto status =
+        jsonParse(load_frame(line), line.size(), &endptr, &value, allocator);
+    CHECK_OK(status, "%s in %s", jsonStrError(status), line.c_str());
+    const auto expected = gason_trade(value);
+    bool matched = false;
+    parser.parse(load_frame(line), line.size(), [&](const auto& message) {
+      if constexpr (is_same_v<decay_t<decltype(message)>, BinanceTrade>) {
+        matched = expected && same_trade(message, *expected);
+      } else {
+        matched = !expected;
+      }
+    });
+    CHECK(matched, "parsers disagree on %s", line.c_str());
+    num_trades += expected.has_value();
+  }
+
+  uint64_t sum = 0;
+  uint64_t start = nanos_monotonic();
+  for (size_t i = 0; i < repeats; ++i) {
+    for (const auto& line : lines) {
+      char* endptr;
+      jsonParse(load_frame(line), line.size(), &endptr, &value, allocator);
+      const auto trade = gason_trade(value);
+      sum += trade ? trade->trade_id : 0;
+    }
+  }
+  const uint64_t gason_nanos = nanos_monotonic() - start;
+
+  const uint64_t fallbacks = parser.fallbacks();
+  start = nanos_monotonic();
+  for (size_t i = 0; i < repeats; ++i) {
+    for (const auto& line : lines) {
+      parser.parse(
+          load_frame(line), line.size(), [&sum](const auto& message) {
+            if constexpr (is_same_v<decay_t<decltype(message)>,
+                                    BinanceTrade>) {
+              sum += message.trade_id;
+            }
+          });
+    }
+  }
+  const uint64_t parser_nanos = nanos_monotonic() - start;
+
+  const double count = static_cast<double>(repeats * lines.size());
+  printf("%zu lines, %zu trades, %llu fell back to gason (%llu)\n",
+         lines.size(), num_trades,
+         static_cast<unsigned long long>((parser.fallbacks() - fallbacks) /
+                                         repeats),
+         static_cast<unsigned long long>(sum & 1));
+  printf("gason:  %7.1f ns/line\n", static_cast<double>(gason_nanos) / count);
+  printf("parser: %7.1f ns/line\n",
+         static_cast<double>(parser_nanos) / count);
+}
+
+// The numbers in |lines|, quoted or not: runs of number characters
+// between a separator or quote and the next, that strtod reads whole.
+vector<string> find_numbers(const vector<string>& lines) {
+  vector<string> numbers;
+  for (const auto& line : lines) {
+    for (size_t i = 0; i < line.size(); ++i) {
+      if (!strchr(":,[\"", line[i]) || i + 1 == line.size() ||
+          !(isdigit(static_cast<unsigned char>(line[i + 1])) ||
+            line[i + 1] == '-')) {
+        continue;
+      }
+      size_t end = i + 1;
+      while (end < line.size() && strchr("0123456789.eE+-", line[end])) {
+        ++end;
+      }
+      if (end == line.size() || !strchr(",]}\"", line[end])) {
+        continue;
+      }
+      const string number = line.substr(i + 1, end - i - 1);
+      char* parsed_end;
+      strtod(number.c_str(), &parsed_end);
+      if (*parsed_end == '\0') {
+        numbers.push_back(number);
+      }
+      i = end - 1;
+    }
+  }
+  return numbers;
+}
+
+// Time per number of |numbers| through atof, strtod, std::from_chars and
+// parse_decimal(), after checking that parse_decimal() reads each to the
+// same double as strtod.
+void bench_decimals(const vector<string>& numbers, size_t repeats) {
+  for (const auto& number : numbers) {
+    double expected = strtod(number.c_str(), nullptr);
+    double value = 0;
+    const char* end = parse_decimal(number.c_str(), &value);
+    CHECK(end && end == number.c_str() + number.size() &&
+              memcmp(&value, &expected, sizeof(value)) == 0,
+          "parse_decimal reads %s as %.17g", number.c_str(), value);
+  }
+
+  const auto time = [&](const char* name, auto&& convert) {
+    double sum = 0;
+    const uint64_t start = nanos_monotonic();
+    for (size_t i = 0; i < repeats; ++i) {
+      for (const auto& number : numbers) {
+        sum += convert(number);
+      }
+    }
+    const uint64_t nanos = nanos_monotonic() - start;
+    printf("%-14s %6.1f ns/number (%g)\n", name,
+           static_cast<double>(nanos) /
+               static_cast<double>(repeats * numbers.size()),
+           sum);
+  };
+  printf("%zu numbers\n", numbers.size());
+  time("atof:", [](const string& number) { return atof(number.c_str()); });
+  time("strtod:", [](const string& number) {
+    return strtod(number.c_str(), nullptr);
+  });
+  time("from_chars:", [](const string& number) {
+    double value = 0;
+    from_chars(number.data(), number.data() + number.size(), value);
+    return value;
+  });
+  time("parse_decimal:", [](const string& number) {
+    double value = 0;
+    return parse_decimal(number.c_str(), &value) ? value : 0;
+  });
+}
+
+}  // namespace
+}  // namespace opentoken
+
+int main(int argc, const char** argv) {
+  using namespace opentoken;
+  CHECK(argc >= 2, "usage: %s <json lines> [repeats]", argv[0]);
+  std::ifstream in(argv[1]);
+  CHECK(in.is_open(), "cannot read %s", argv[1]);
+  std::vector<std::string> lines;
+  for (std::string line; std::getline(in, line);) {
+    if (!line.empty()) {
+      lines.push_back(line);
+    }
+  }
+  const size_t repeats = argc < 3 ? 100 : std::stoul(argv[2]);
+  bench(lines, repeats);
+  bench_decimals(find_numbers(lines), repeats);
+}
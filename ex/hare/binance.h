@@ -1,14 +1,19 @@
 #ifndef _OPENTOKEN__HARE__BINANCE_H_
 #define _OPENTOKEN__HARE__BINANCE_H_
 
+#include "decimal.h"
 #include "hasher.h"
 #include "util.h"
 
 #include "gason/gason.h"
 
 #include <inttypes.h>
+#include <algorithm>
+#include <cstddef>
 #include <cstdlib>
+#include <cstring>
 #include <optional>
+#include <vector>
 
 namespace opentoken {
 
@@ -20,9 +25,68 @@ struct BinanceTrade {
   char market[16];      // s
 };
 
-struct TradeMessage {
-  BinanceTrade trade;
-  uint8_t signature[kHashSizeBytes];
+// One side of the book at one price. A quantity of 0 removes the level.
+struct PriceLevel {
+  double price;
+  double quantity;
+};
+
+// Most bid plus ask levels a BinanceDepthUpdate holds, so that one fits a
+// datagram.
+constexpr size_t kMaxDepthLevels = 64;
+
+// A <symbol>@depth diff, or part |part| of one. A diff with more than
+// kMaxDepthLevels levels comes in |num_parts| parts with the same ids, each
+// with the next kMaxDepthLevels of its bids and then asks. Applying every
+// part applies the diff. Only the first num_bids + num_asks levels are set,
+// bids first.
+struct BinanceDepthUpdate {
+  uint64_t event_time;       // E
+  uint64_t first_update_id;  // U
+  uint64_t final_update_id;  // u
+  char market[16];           // s
+  uint16_t num_bids;         // b
+  uint16_t num_asks;         // a
+  uint16_t part;
+  uint16_t num_parts;
+  PriceLevel levels[kMaxDepthLevels];
+};
+
+// A <symbol>@bookTicker update of the best bid and ask.
+struct BinanceBookTicker {
+  double bid_price;     // b
+  double bid_quantity;  // B
+  double ask_price;     // a
+  double ask_quantity;  // A
+  uint64_t update_id;   // u
+  char market[16];      // s
+};
+
+// A 24hrTicker of the !ticker@arr or <symbol>@ticker streams: the rolling
+// 24 hour statistics of a market. Trade ids are -1 without trades.
+struct BinanceTicker {
+  uint64_t event_time;          // E
+  uint64_t open_time;           // O
+  uint64_t close_time;          // C
+  int64_t first_trade_id;       // F
+  int64_t last_trade_id;        // L
+  uint64_t num_trades;          // n
+  double price_change;          // p
+  double price_change_percent;  // P
+  double weighted_avg_price;    // w
+  double prev_close_price;      // x
+  double last_price;            // c
+  double last_quantity;         // Q
+  double bid_price;             // b
+  double bid_quantity;          // B
+  double ask_price;             // a
+  double ask_quantity;          // A
+  double open_price;            // o
+  double high_price;            // h
+  double low_price;             // l
+  double volume;                // v
+  double quote_volume;          // q
+  char market[16];              // s
 };
 
 namespace {
@@ -75,24 +139,564 @@ std::optional<BinanceTrade> json_to_binance_trade(const gason::JsonValue& obj) {
   return {result};
 };
 
+// A one pass reader of Binance @trade objects such as
+//
+//   {"e":"trade","E":123456789,"s":"BNBBTC","t":12345,"p":"0.001",
+//    "q":"100","b":88,"a":50,"T":123456785,"m":true,"M":true}
+//
+// that finds "p", "q", "t", "T" and "s" in place instead of building a
+// gason tree. It reads the keys in any order but gives up on anything it is
+// not sure of, such as escapes, nested values, another event type or a
+// missing or repeated field, leaving the buffer untouched for gason. It
+// reads nothing past the object's |length| bytes, which need not be
+// followed by a terminator: WSS frames are read in place.
+class BinanceTradeScanner final {
+ public:
+  // Fills in |trade| from the object at |data| if it is a trade.
+  static bool scan(const char* data, size_t length, BinanceTrade* trade) {
+    const char* const end = data + length;
+    const char* p = skip_space(data, end);
+    if (p == end || *p++ != '{') {
+      return false;
+    }
+    unsigned found = 0;
+    while (true) {
+      const char* key;
+      const char* key_end;
+      p = skip_space(p, end);
+      if (!(p = scan_string(p, end, &key, &key_end))) {
+        return false;
+      }
+      p = skip_space(p, end);
+      if (p == end || *p++ != ':') {
+        return false;
+      }
+      p = skip_space(p, end);
+
+      const unsigned field = key_end - key == 1 ? field_of(*key) : 0;
+      if (field & found) {
+        return false;
+      }
+      found |= field;
+      const char* value;
+      const char* value_end;
+      switch (field) {
+        case kEvent:
+          if (!(p = scan_string(p, end, &value, &value_end)) ||
+              value_end - value != 5 || std::memcmp(value, "trade", 5) != 0) {
+            return false;
+          }
+          break;
+        case kMarket:
+          if (!(p = scan_string(p, end, &value, &value_end)) ||
+              static_cast<size_t>(value_end - value) >=
+                  sizeof(trade->market)) {
+            return false;
+          }
+          std::memcpy(trade->market, value,
+                      static_cast<size_t>(value_end - value));
+          std::memset(trade->market + (value_end - value), 0,
+                      sizeof(trade->market) -
+                          static_cast<size_t>(value_end - value));
+          break;
+        case kPrice:
+          p = scan_decimal(p, end, &trade->price);
+          break;
+        case kQuantity:
+          p = scan_decimal(p, end, &trade->quantity);
+          break;
+        case kTradeId:
+          p = scan_uint(p, end, &trade->trade_id);
+          break;
+        case kTradeTime:
+          p = scan_uint(p, end, &trade->trade_time);
+          break;
+        default:
+          p = skip_scalar(p, end);
+          break;
+      }
+      if (!p) {
+        return false;
+      }
+
+      p = skip_space(p, end);
+      if (p == end) {
+        return false;
+      }
+      if (*p == '}') {
+        return found == kAllFields && skip_space(p + 1, end) == end;
+      }
+      if (*p++ != ',') {
+        return false;
+      }
+    }
+  }
+
+ private:
+  enum : unsigned {
+    kEvent = 1,
+    kMarket = 2,
+    kPrice = 4,
+    kQuantity = 8,
+    kTradeId = 16,
+    kTradeTime = 32,
+    kAllFields = 63,
+  };
+
+  static unsigned field_of(char key) {
+    switch (key) {
+      case 'e':
+        return kEvent;
+      case 's':
+        return kMarket;
+      case 'p':
+        return kPrice;
+      case 'q':
+        return kQuantity;
+      case 't':
+        return kTradeId;
+      case 'T':
+        return kTradeTime;
+      default:
+        return 0;
+    }
+  }
+
+  static const char* skip_space(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+      ++p;
+    }
+    return p;
+  }
+
+  // Returns the end of the string at |p|, and its contents in |begin| to
+  // |string_end|, or nullptr if it is not a string without escapes.
+  static const char* scan_string(const char* p, const char* end,
+                                 const char** begin, const char** string_end) {
+    if (p == end || *p != '"') {
+      return nullptr;
+    }
+    *begin = ++p;
+    while (p < end && *p != '"') {
+      if (*p == '\\' || *p == '\0') {
+        return nullptr;
+      }
+      ++p;
+    }
+    if (p == end) {
+      return nullptr;
+    }
+    *string_end = p;
+    return p + 1;
+  }
+
+  static bool is_number_char(char c) {
+    return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' ||
+           c == 'e' || c == 'E';
+  }
+
+  // Reads a decimal, quoted as Binance sends prices and quantities or not,
+  // the way gason would.
+  static const char* scan_decimal(const char* p, const char* end,
+                                  double* value) {
+    if (p == end) {
+      return nullptr;
+    }
+    const bool quoted = *p == '"';
+    const char* const number_end = parse_decimal(p + quoted, end, value);
+    if (!number_end) {
+      return nullptr;
+    }
+    if (quoted ? number_end == end || *number_end != '"'
+               : number_end != end && is_number_char(*number_end)) {
+      return nullptr;
+    }
+    return number_end + quoted;
+  }
+
+  static const char* scan_uint(const char* p, const char* end,
+                               uint64_t* value) {
+    const char* const begin = p;
+    uint64_t result = 0;
+    // At most 19 digits, so that it cannot overflow.
+    while (p < end && *p >= '0' && *p <= '9' && p - begin < 19) {
+      result = result * 10 + static_cast<uint64_t>(*p - '0');
+      ++p;
+    }
+    if (p == begin || (p < end && is_number_char(*p))) {
+      return nullptr;
+    }
+    *value = result;
+    return p;
+  }
+
+  // Skips a string, number, true, false or null.
+  static const char* skip_scalar(const char* p, const char* end) {
+    const char* ignored;
+    if (p == end) {
+      return nullptr;
+    }
+    switch (*p) {
+      case '"':
+        return scan_string(p, end, &ignored, &ignored);
+      case 't':
+        return skip_literal(p, end, "true");
+      case 'f':
+        return skip_literal(p, end, "false");
+      case 'n':
+        return skip_literal(p, end, "null");
+      default:
+        break;
+    }
+    const char* const begin = p;
+    while (p < end && is_number_char(*p)) {
+      ++p;
+    }
+    return p == begin ? nullptr : p;
+  }
+
+  template <size_t N>
+  static const char* skip_literal(const char* p, const char* end,
+                                  const char (&literal)[N]) {
+    constexpr size_t kLength = N - 1;
+    return static_cast<size_t>(end - p) >= kLength &&
+                   std::memcmp(p, literal, kLength) == 0
+               ? p + kLength
+               : nullptr;
+  }
+};
+
+// Reads the number, quoted or not, in |v|. Returns false if it is neither.
+bool json_to_number(const gason::JsonValue& v, double* number) {
+  using namespace gason;
+  if (v.getTag() != JsonTag::JSON_NUMBER &&
+      v.getTag() != JsonTag::JSON_STRING) {
+    return false;
+  }
+  *number = v.toNumberAlways();
+  return true;
+}
+
+bool json_to_market(const gason::JsonValue& v, char (&market)[16]) {
+  if (v.getTag() != gason::JsonTag::JSON_STRING ||
+      strlen(v.toString()) + 1 > sizeof(market)) {
+    return false;
+  }
+  std::strcpy(market, v.toString());
+  return true;
+}
+
+// Appends the [price, quantity] pairs in |v| to |levels|. Returns false if
+// they are malformed.
+bool json_to_price_levels(const gason::JsonValue& v,
+                          std::vector<PriceLevel>* levels) {
+  using namespace gason;
+  if (v.getTag() != JsonTag::JSON_ARRAY) {
+    return false;
+  }
+  for (auto level : v) {
+    if (level->value.getTag() != JsonTag::JSON_ARRAY) {
+      return false;
+    }
+    PriceLevel result;
+    auto it = begin(level->value);
+    if (!(it != end(level->value)) ||
+        !json_to_number(it->value, &result.price)) {
+      return false;
+    }
+    ++it;
+    if (!(it != end(level->value)) ||
+        !json_to_number(it->value, &result.quantity)) {
+      return false;
+    }
+    levels->push_back(result);
+  }
+  return true;
+}
+
+// Where json_to_fields() puts the number, quoted or not, under |key|.
+struct JsonField {
+  enum class Type : uint8_t {
+    Double,
+    Uint64,
+    Int64,
+  };
+
+  const char* key;
+  size_t offset;
+  Type type;
+};
+
+// Reads |v| into the |field| of |message|. Returns false if it is not a
+// number or out of range for the field.
+bool json_to_field(const gason::JsonValue& v, const JsonField& field,
+                   void* message) {
+  double number;
+  if (!json_to_number(v, &number)) {
+    return false;
+  }
+  char* const dest = static_cast<char*>(message) + field.offset;
+  switch (field.type) {
+    case JsonField::Type::Double:
+      std::memcpy(dest, &number, sizeof(number));
+      return true;
+    case JsonField::Type::Uint64: {
+      if (!(number >= 0 && number < 0x1p64)) {
+        return false;
+      }
+      const auto value = static_cast<uint64_t>(number);
+      std::memcpy(dest, &value, sizeof(value));
+      return true;
+    }
+    case JsonField::Type::Int64: {
+      if (!(number >= -0x1p63 && number < 0x1p63)) {
+        return false;
+      }
+      const auto value = static_cast<int64_t>(number);
+      std::memcpy(dest, &value, sizeof(value));
+      return true;
+    }
+  }
+  return false;
+}
+
+// Reads the |fields| and "s" market of |obj| into |message|, ignoring its
+// other keys. Returns false unless each is there once and well formed.
+template <size_t N>
+bool json_to_fields(const gason::JsonValue& obj, const JsonField (&fields)[N],
+                    void* message, char (&market)[16]) {
+  static_assert(N < 64, "too many fields for the mask");
+  uint64_t found = 0;
+  bool found_market = false;
+  for (auto pair : obj) {
+    if (str_eq("s", pair->key)) {
+      if (found_market || !json_to_market(pair->value, market)) {
+        return false;
+      }
+      found_market = true;
+      continue;
+    }
+    for (size_t i = 0; i < N; ++i) {
+      if (!str_eq(fields[i].key, pair->key)) {
+        continue;
+      }
+      if ((found >> i & 1) || !json_to_field(pair->value, fields[i], message)) {
+        return false;
+      }
+      found |= 1ULL << i;
+      break;
+    }
+  }
+  return found_market && found == (1ULL << N) - 1;
+}
+
+bool json_to_binance_book_ticker(const gason::JsonValue& obj,
+                                 BinanceBookTicker* ticker) {
+  using Type = JsonField::Type;
+  static constexpr JsonField kFields[] = {
+      {"b", offsetof(BinanceBookTicker, bid_price), Type::Double},
+      {"B", offsetof(BinanceBookTicker, bid_quantity), Type::Double},
+      {"a", offsetof(BinanceBookTicker, ask_price), Type::Double},
+      {"A", offsetof(BinanceBookTicker, ask_quantity), Type::Double},
+      {"u", offsetof(BinanceBookTicker, update_id), Type::Uint64},
+  };
+  return json_to_fields(obj, kFields, ticker, ticker->market);
+}
+
+bool json_to_binance_ticker(const gason::JsonValue& obj,
+                            BinanceTicker* ticker) {
+  using Type = JsonField::Type;
+  static constexpr JsonField kFields[] = {
+      {"E", offsetof(BinanceTicker, event_time), Type::Uint64},
+      {"O", offsetof(BinanceTicker, open_time), Type::Uint64},
+      {"C", offsetof(BinanceTicker, close_time), Type::Uint64},
+      {"F", offsetof(BinanceTicker, first_trade_id), Type::Int64},
+      {"L", offsetof(BinanceTicker, last_trade_id), Type::Int64},
+      {"n", offsetof(BinanceTicker, num_trades), Type::Uint64},
+      {"p", offsetof(BinanceTicker, price_change), Type::Double},
+      {"P", offsetof(BinanceTicker, price_change_percent), Type::Double},
+      {"w", offsetof(BinanceTicker, weighted_avg_price), Type::Double},
+      {"x", offsetof(BinanceTicker, prev_close_price), Type::Double},
+      {"c", offsetof(BinanceTicker, last_price), Type::Double},
+      {"Q", offsetof(BinanceTicker, last_quantity), Type::Double},
+      {"b", offsetof(BinanceTicker, bid_price), Type::Double},
+      {"B", offsetof(BinanceTicker, bid_quantity), Type::Double},
+      {"a", offsetof(BinanceTicker, ask_price), Type::Double},
+      {"A", offsetof(BinanceTicker, ask_quantity), Type::Double},
+      {"o", offsetof(BinanceTicker, open_price), Type::Double},
+      {"h", offsetof(BinanceTicker, high_price), Type::Double},
+      {"l", offsetof(BinanceTicker, low_price), Type::Double},
+      {"v", offsetof(BinanceTicker, volume), Type::Double},
+      {"q", offsetof(BinanceTicker, quote_volume), Type::Double},
+  };
+  return json_to_fields(obj, kFields, ticker, ticker->market);
+}
+
 class BinanceTradeParser final {
  public:
   BinanceTradeParser() = default;
 
-  std::optional<BinanceTrade> parse_trade(char* trade_data) {
+  std::optional<BinanceTrade> parse_trade(char* trade_data, size_t length) {
+    BinanceTrade trade;
+    if (BinanceTradeScanner::scan(trade_data, length, &trade)) {
+      return {trade};
+    }
+    ++fallbacks_;
     char* endptr;
-    const auto status = jsonParse(trade_data, &endptr, &value_, allocator_);
+    const auto status =
+        jsonParse(trade_data, length, &endptr, &value_, allocator_);
     CHECK_OK(status, "%s at %zd\n", jsonStrError(status), endptr - trade_data);
     const auto parsed = json_to_binance_trade(value_);
     return parsed;
   }
 
+  // Calls on_message(message) with each BinanceTrade, BinanceDepthUpdate,
+  // BinanceBookTicker and BinanceTicker in the |length| bytes at |data|,
+  // which need not be terminated: an object, or an array of them as
+  // !ticker@arr sends. Depth updates of more than kMaxDepthLevels levels
+  // come in parts. Book tickers are the objects without an event type.
+  // Anything else is counted in skipped().
+  //
+  // Trades are read by BinanceTradeScanner, everything it gives up on by
+  // gason.
+  template <typename F>
+  void parse(char* data, size_t length, const F& on_message) {
+    using namespace gason;
+    BinanceTrade scanned;
+    if (BinanceTradeScanner::scan(data, length, &scanned)) {
+      on_message(scanned);
+      return;
+    }
+    ++fallbacks_;
+    char* endptr;
+    const auto status = jsonParse(data, length, &endptr, &value_, allocator_);
+    CHECK_OK(status, "%s at %zd\n", jsonStrError(status), endptr - data);
+    if (value_.getTag() != JsonTag::JSON_ARRAY) {
+      parse_object(value_, on_message);
+      return;
+    }
+    for (auto element : value_) {
+      parse_object(element->value, on_message);
+    }
+  }
+
+  uint64_t skipped() const { return skipped_; }
+  // Messages that BinanceTradeScanner could not read: everything but
+  // trades, and trades laid out in a way it does not expect.
+  uint64_t fallbacks() const { return fallbacks_; }
+
  private:
   BinanceTradeParser(BinanceTradeParser&) = delete;
   BinanceTradeParser(BinanceTradeParser&&) = delete;
 
+  template <typename F>
+  void parse_object(const gason::JsonValue& obj, const F& on_message) {
+    using namespace gason;
+    if (obj.getTag() != JsonTag::JSON_OBJECT) {
+      ++skipped_;
+      return;
+    }
+
+    const char* event = nullptr;
+    for (auto pair : obj) {
+      if (str_eq("e", pair->key) &&
+          pair->value.getTag() == JsonTag::JSON_STRING) {
+        event = pair->value.toString();
+        break;
+      }
+    }
+    if (!event) {
+      BinanceBookTicker ticker{};
+      if (json_to_binance_book_ticker(obj, &ticker)) {
+        on_message(ticker);
+        return;
+      }
+    } else if (str_eq("trade", event)) {
+      const auto trade = json_to_binance_trade(obj);
+      if (trade) {
+        on_message(*trade);
+        return;
+      }
+    } else if (str_eq("depthUpdate", event)) {
+      if (parse_depth_update(obj, on_message)) {
+        return;
+      }
+    } else if (str_eq("24hrTicker", event)) {
+      BinanceTicker ticker{};
+      if (json_to_binance_ticker(obj, &ticker)) {
+        on_message(ticker);
+        return;
+      }
+    }
+    ++skipped_;
+  }
+
+  // Hands on_message() the depth update in |obj| in as few parts as hold
+  // its levels, bids before asks. Returns false, before handing over any
+  // part, if it is malformed.
+  template <typename F>
+  bool parse_depth_update(const gason::JsonValue& obj, const F& on_message) {
+    using Type = JsonField::Type;
+    static constexpr JsonField kFields[] = {
+        {"E", offsetof(BinanceDepthUpdate, event_time), Type::Uint64},
+        {"U", offsetof(BinanceDepthUpdate, first_update_id), Type::Uint64},
+        {"u", offsetof(BinanceDepthUpdate, final_update_id), Type::Uint64},
+    };
+    // Clears all but the levels, which are only read up to the counts.
+    std::memset(&depth_update_, 0, offsetof(BinanceDepthUpdate, levels));
+    bids_.clear();
+    asks_.clear();
+    bool found_bids = false;
+    bool found_asks = false;
+    for (auto pair : obj) {
+      if (str_eq("b", pair->key)) {
+        if (found_bids || !json_to_price_levels(pair->value, &bids_)) {
+          return false;
+        }
+        found_bids = true;
+      } else if (str_eq("a", pair->key)) {
+        if (found_asks || !json_to_price_levels(pair->value, &asks_)) {
+          return false;
+        }
+        found_asks = true;
+      }
+    }
+    const size_t num_levels = bids_.size() + asks_.size();
+    const size_t num_parts =
+        std::max<size_t>(1, (num_levels + kMaxDepthLevels - 1) /
+                                kMaxDepthLevels);
+    if (!found_bids || !found_asks || num_parts > UINT16_MAX ||
+        !json_to_fields(obj, kFields, &depth_update_, depth_update_.market)) {
+      return false;
+    }
+
+    depth_update_.num_parts = static_cast<uint16_t>(num_parts);
+    for (size_t part = 0; part < num_parts; ++part) {
+      const size_t first = part * kMaxDepthLevels;
+      const size_t last = std::min(num_levels, first + kMaxDepthLevels);
+      const size_t bids_end = std::min(bids_.size(), last);
+      const size_t num_bids = first < bids_end ? bids_end - first : 0;
+      const size_t asks_begin = std::max(first, bids_.size()) - bids_.size();
+      const size_t num_asks = last - first - num_bids;
+      std::copy_n(bids_.data() + first, num_bids, depth_update_.levels);
+      std::copy_n(asks_.data() + asks_begin, num_asks,
+                  depth_update_.levels + num_bids);
+      depth_update_.part = static_cast<uint16_t>(part);
+      depth_update_.num_bids = static_cast<uint16_t>(num_bids);
+      depth_update_.num_asks = static_cast<uint16_t>(num_asks);
+      on_message(depth_update_);
+    }
+    return true;
+  }
+
   gason::JsonValue value_;
   gason::JsonAllocator allocator_;
+  BinanceDepthUpdate depth_update_;
+  // The levels of the depth update being split into parts.
+  std::vector<PriceLevel> bids_;
+  std::vector<PriceLevel> asks_;
+  uint64_t skipped_ = 0;
+  uint64_t fallbacks_ = 0;
 };
 
 class BinanceFileReader final {
@@ -104,7 +708,10 @@ class BinanceFileReader final {
 
   std::optional<BinanceTrade> read_one() {
     auto line = line_reader_.read_line();
-    return trade_parser_.parse_trade(line);
+    if (!line) {
+      return {};
+    }
+    return trade_parser_.parse_trade(line, strlen(line));
   }
 
  private:
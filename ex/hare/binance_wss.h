@@ -3,6 +3,8 @@
 
 #include "binance.h"
 #include "check.h"
+#include "event_loop.h"
+#include "network.h"
 
 #include <cstdio>
 #include <string>
@@ -11,57 +13,83 @@
 namespace opentoken {
 namespace {
 
+// Reads market data from one WSS connection on |loop|, which may be shared
+// with other connections and sources. The handler is called with each
+// BinanceTrade, BinanceDepthUpdate, BinanceBookTicker and BinanceTicker,
+// see BinanceTradeParser::parse().
 class BinanceWSSReader final {
  public:
   template <typename F>
-  BinanceWSSReader(const char* wss_input_uri, const F& onTradeHandler)
-      : poll_fd_(-1) {
-    h_.onMessage([onTradeHandler, this](uWS::WebSocket<uWS::CLIENT>* /*ws*/,
-                                        char* message, size_t /*length*/,
-                                        uWS::OpCode /*opCode*/) {
-      const auto parsed = trade_parser_.parse_trade(message);
-      if (parsed) {
-        onTradeHandler(*parsed);
-      }
+  BinanceWSSReader(EventLoop* loop, const char* wss_input_uri,
+                   const F& onMessageHandler)
+      : poll_fd_(-1),
+        group_(CHECK_NOTNULL(loop)->hub()->createGroup<uWS::CLIENT>()) {
+    group_->onMessage([onMessageHandler, loop, this](
+                          uWS::WebSocket<uWS::CLIENT>* /*ws*/, char* message,
+                          size_t length, uWS::OpCode /*opCode*/) {
+      // |message| is read in place, followed by whatever uWS read after it.
+      parser_.parse(message, length, onMessageHandler);
+#ifndef USE_EPOLL
+      loop->end_batch();
+#else
+      (void)loop;
+#endif
     });
 
-    h_.onError(
+    group_->onError(
         [](void* /*user*/) { FAIL("FAILURE: Connection failed! Timeout?"); });
 
-    h_.onDisconnection([](uWS::WebSocket<uWS::CLIENT>* /*ws*/, int code,
-                          char* message, size_t length) {
+    group_->onDisconnection([](uWS::WebSocket<uWS::CLIENT>* /*ws*/, int code,
+                               char* message, size_t length) {
       FAIL("Disconnected. code: %d, message %s\n", code,
            std::string(message, length).c_str());
     });
 
-    h_.onConnection(
+    group_->onConnection(
         [this](uWS::WebSocket<uWS::CLIENT>* ws, uWS::HttpRequest /*req*/) {
           poll_fd_ = ws->getFd();
+          enable_rx_timestamps(poll_fd_);
           fprintf(stderr, "Connected!\n");
         });
 
-    h_.onPing([](uWS::WebSocket<uWS::CLIENT>* ws, char* /*message*/,
-                 size_t /*length*/) {
+    group_->onPing([](uWS::WebSocket<uWS::CLIENT>* ws, char* /*message*/,
+                      size_t /*length*/) {
       // TODO(mgraczyk): Is any message necessary?
       ws->send("", uWS::OpCode::PONG);
     });
 
-    h_.connect(wss_input_uri);
+    // Runs right after each epoll_wait, before uWS reads the socket.
+    loop->on_wakeup([this]() {
+      rx_nanos_ = has_fd() ? peek_rx_timestamp_nanos(poll_fd_) : 0;
+    });
+
+    loop->hub()->connect(wss_input_uri, nullptr, {}, 5000, group_);
   }
 
   int fd() const { return poll_fd_; }
+  // Kernel receive time, in nanoseconds since the epoch, of the first bytes
+  // read in the current batch of frames, or 0 if unknown. Frames that span
+  // several TCP segments are stamped with the earliest one.
+  uint64_t rx_nanos() const { return rx_nanos_; }
   int has_fd() const { return poll_fd_ >= 0; }
 
-  void run() { h_.run(); }
-  void poll() { h_.poll(); }
+  // Writes how many messages were skipped as unknown or malformed, and how
+  // many BinanceTradeScanner left to gason.
+  void report(FILE* f, const char* name) const {
+    fprintf(f, "%s: %llu messages skipped, %llu parsed by gason\n", name,
+            static_cast<unsigned long long>(parser_.skipped()),
+            static_cast<unsigned long long>(parser_.fallbacks()));
+  }
 
  private:
   BinanceWSSReader(BinanceWSSReader&) = delete;
   BinanceWSSReader(BinanceWSSReader&&) = delete;
 
   int poll_fd_;
-  uWS::Hub h_;
-  BinanceTradeParser trade_parser_;
+  uint64_t rx_nanos_ = 0;
+  // Lives as long as the hub, like the connection in it.
+  uWS::Group<uWS::CLIENT>* const group_;
+  BinanceTradeParser parser_;
 };
 
 }  // namespace
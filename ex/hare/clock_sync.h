@@ -0,0 +1,76 @@
+#ifndef _OPENTOKEN__HARE__CLOCK_SYNC_H_
+#define _OPENTOKEN__HARE__CLOCK_SYNC_H_
+
+#include "check.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace opentoken {
+
+// One NTP style round trip: we send a TimeRequest at |request_tx_nanos|, the
+// peer receives it at |request_rx_nanos| and replies at |reply_tx_nanos|, by
+// its own clock. Filled in along the way and echoed back in the TimeReply.
+struct ClockSample {
+  uint64_t request_tx_nanos;
+  uint64_t request_rx_nanos;
+  uint64_t reply_tx_nanos;
+};
+
+// Estimates how far a peer's clock is ahead of ours from round trips,
+// trusting the one with the lowest network delay among the last |window|,
+// as NTP's clock filter does: queueing on either path only ever adds delay,
+// and skews the offset by at most half of it.
+class ClockOffsetEstimator final {
+ public:
+  explicit ClockOffsetEstimator(size_t window = 8) : samples_(window) {
+    CHECK(window > 0);
+  }
+
+  // Adds |sample|, whose reply we received at |reply_rx_nanos|.
+  void add(const ClockSample& sample, uint64_t reply_rx_nanos) {
+    const auto t1 = static_cast<int64_t>(sample.request_tx_nanos);
+    const auto t2 = static_cast<int64_t>(sample.request_rx_nanos);
+    const auto t3 = static_cast<int64_t>(sample.reply_tx_nanos);
+    const auto t4 = static_cast<int64_t>(reply_rx_nanos);
+    const int64_t delay = (t4 - t1) - (t3 - t2);
+    if (t3 < t2 || delay < 0) {
+      return;
+    }
+
+    samples_[num_samples_++ % samples_.size()] =
+        Sample{((t2 - t1) + (t3 - t4)) / 2, delay};
+    const size_t num_valid = std::min(num_samples_, samples_.size());
+    best_ = samples_[0];
+    for (size_t i = 1; i < num_valid; ++i) {
+      if (samples_[i].delay_nanos < best_.delay_nanos) {
+        best_ = samples_[i];
+      }
+    }
+  }
+
+  bool valid() const { return num_samples_ > 0; }
+  int64_t offset_nanos() const { return best_.offset_nanos; }
+  int64_t delay_nanos() const { return best_.delay_nanos; }
+
+  // Converts a time read off the peer's clock to ours, or 0 to 0.
+  uint64_t to_local(uint64_t peer_nanos) const {
+    return peer_nanos ? peer_nanos - static_cast<uint64_t>(best_.offset_nanos)
+                      : 0;
+  }
+
+ private:
+  struct Sample {
+    int64_t offset_nanos;
+    int64_t delay_nanos;
+  };
+
+  std::vector<Sample> samples_;
+  size_t num_samples_ = 0;
+  Sample best_{};
+};
+
+}  // namespace opentoken
+
+#endif  // _OPENTOKEN__HARE__CLOCK_SYNC_H_
@@ -15,6 +15,35 @@ enum class CoinCode : uint32_t {
   ZeroX,
 };
 
+struct SymbolInfo {
+  const char* market;
+  CoinCode base;
+  CoinCode quote;
+  // Decimals in the exchange's price and quantity steps.
+  uint8_t price_decimals;
+  uint8_t quantity_decimals;
+};
+
+// Markets with a compact id, their index here, which goes on the wire in
+// place of the name. Only ever append, and never change an entry: peers
+// agree on how many they share and refuse compact ids if those differ.
+constexpr SymbolInfo kSymbols[] = {
+    {"", CoinCode::Unknown, CoinCode::Unknown, 0, 0},  // id 0: not listed
+    {"BTCUSDT", CoinCode::Bitcoin, CoinCode::Tether, 2, 6},
+    {"ETHUSDT", CoinCode::Ethereum, CoinCode::Tether, 2, 5},
+    {"ETHBTC", CoinCode::Ethereum, CoinCode::Bitcoin, 6, 4},
+    {"LTCUSDT", CoinCode::LiteCoin, CoinCode::Tether, 2, 5},
+    {"LTCBTC", CoinCode::LiteCoin, CoinCode::Bitcoin, 6, 3},
+    {"LTCETH", CoinCode::LiteCoin, CoinCode::Ethereum, 5, 3},
+    {"TRXUSDT", CoinCode::Tron, CoinCode::Tether, 5, 1},
+    {"TRXBTC", CoinCode::Tron, CoinCode::Bitcoin, 8, 0},
+    {"TRXETH", CoinCode::Tron, CoinCode::Ethereum, 8, 0},
+    {"ZRXUSDT", CoinCode::ZeroX, CoinCode::Tether, 4, 0},
+    {"ZRXBTC", CoinCode::ZeroX, CoinCode::Bitcoin, 8, 0},
+    {"ZRXETH", CoinCode::ZeroX, CoinCode::Ethereum, 8, 0},
+};
+constexpr uint32_t kNumSymbols = sizeof(kSymbols) / sizeof(kSymbols[0]);
+
 }  // namespace opentoken
 
 #endif  // _OPENTOKEN__HARE__COINS_H_
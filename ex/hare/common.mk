@@ -4,7 +4,7 @@ UNAME_S:=$(shell uname -s)
 
 CXX:=g++
 INCLUDES:=-isystem /usr/local/opt/openssl/include/ -I$(ROOT) -isystem $(ROOT)uWebSockets/src/
-CXX_FLAGS:=-g --std=gnu++17 -Wfatal-errors -Wall -Wextra -Wpedantic -Wconversion -Wshadow -Wno-format-security -Wno-c99-extensions -O3 -flto $(INCLUDES)
+CXX_FLAGS:=-g --std=gnu++17 -Wfatal-errors -Wall -Wextra -Wpedantic -Wconversion -Wshadow -Wno-format-security -Wno-c99-extensions -O3 -flto -pthread $(INCLUDES)
 LDFLAGS:=-L/usr/local/opt/openssl/lib/ -lssl -lcrypto -L$(ROOT) -luWS -lz -flto
 
 ifeq ($(UNAME_S),Darwin)
@@ -58,7 +58,7 @@ run: $(BIN)
 test:
 	make -C ./test
 
-.PHONY : clean $(BIN) test receiver sender wsscat wssreplay
+.PHONY : clean $(BIN) test receiver sender wsscat wssreplay mac_bench parse_bench
 .DELETE_ON_ERROR:
 clean :
 	-rm -f $(ROOT)$(BIN) $(BUILD_DIR)/$(BIN) $(OBJ) $(DEP) $(ROOT)$(LIBUWS)
@@ -0,0 +1,193 @@
+#ifndef _OPENTOKEN__HARE__EVENT_LOOP_H_
+#define _OPENTOKEN__HARE__EVENT_LOOP_H_
+
+#include "check.h"
+
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "uWS.h"
+
+namespace opentoken {
+
+// A uWS Hub and its event loop, shared by every source of work on a thread:
+// WSS connections, sockets and timers. Each wakeup costs one epoll_wait
+// however many sources there are.
+class EventLoop final {
+ public:
+  // Hooks into the loop around each wakeup. uWS may have hooks there
+  // already, e.g. to take its lock with UWS_THREADSAFE, which keep running
+  // outside ours.
+  EventLoop() {
+#ifdef USE_EPOLL
+    auto* loop = hub_.getLoop();
+    next_pre_cb_ = loop->preCb;
+    next_pre_cb_data_ = loop->preCbData;
+    loop->preCbData = this;
+    loop->preCb = [](void* data) {
+      auto* self = static_cast<EventLoop*>(data);
+      if (self->next_pre_cb_) {
+        self->next_pre_cb_(self->next_pre_cb_data_);
+      }
+      for (const auto& handler : self->on_wakeup_) {
+        handler();
+      }
+    };
+    next_post_cb_ = loop->postCb;
+    next_post_cb_data_ = loop->postCbData;
+    loop->postCbData = this;
+    loop->postCb = [](void* data) {
+      auto* self = static_cast<EventLoop*>(data);
+      self->end_batch();
+      if (self->next_post_cb_) {
+        self->next_post_cb_(self->next_post_cb_data_);
+      }
+    };
+#endif
+  }
+
+  ~EventLoop() {
+    for (auto& timer : timers_) {
+      timer->timer->stop();
+      timer->timer->close();
+    }
+  }
+
+  uWS::Hub* hub() { return &hub_; }
+
+  // Calls |handler| right after each wakeup, before any source is read.
+  // Without the epoll backend there is no such hook.
+  template <typename F>
+  void on_wakeup(const F& handler) {
+    on_wakeup_.emplace_back(handler);
+  }
+
+  // Calls |handler| after each wakeup, once every source that was ready has
+  // been read. Without the epoll backend sources call end_batch() after
+  // each read instead.
+  template <typename F>
+  void on_batch_end(const F& handler) {
+    on_batch_end_.emplace_back(handler);
+  }
+
+  void end_batch() {
+    for (const auto& handler : on_batch_end_) {
+      handler();
+    }
+  }
+
+  // Calls |handler| every |interval_ms|, followed by the batch end
+  // handlers, so that work gets done while every source is quiet.
+  template <typename F>
+  void every(int interval_ms, const F& handler) {
+    CHECK(interval_ms > 0);
+    timers_.emplace_back(new Timer{new uS::Timer(hub_.getLoop()),
+                                   with_batch_end(handler)});
+    uS::Timer* timer = timers_.back()->timer;
+    timer->setData(timers_.back().get());
+    timer->start(
+        [](uS::Timer* expired) {
+          static_cast<Timer*>(expired->getData())->handler();
+        },
+        interval_ms, interval_ms);
+  }
+
+  // Calls |handler| whenever |fd| has data to read. |fd| stays blocking, so
+  // the handler should read with MSG_DONTWAIT until it is drained.
+  template <typename F>
+  void on_readable(int fd, const F& handler) {
+    const int flags = fcntl(fd, F_GETFL, 0);
+    CHECK_ERRNO(flags >= 0);
+    sources_.emplace_back(
+        new ReadableSource{hub_.getLoop(), fd, with_batch_end(handler)});
+    // uS::Poll made |fd| non-blocking, which sends on it should not be.
+    CHECK_ERRNO(fcntl(fd, F_SETFL, flags) == 0);
+  }
+
+  // Stops or resumes calling the handler of |fd|, e.g. while there is
+  // nowhere to read its data to.
+  void watch_readable(int fd, bool watch) {
+    for (auto& source : sources_) {
+      if (source->getFd() == fd) {
+        source->watch(watch);
+        return;
+      }
+    }
+    FAIL("fd %d is not watched", fd);
+  }
+
+  void run() { hub_.run(); }
+
+ private:
+  EventLoop(EventLoop&) = delete;
+  EventLoop(EventLoop&&) = delete;
+
+  struct Timer {
+    uS::Timer* timer;
+    std::function<void()> handler;
+  };
+
+  class ReadableSource final : public uS::Poll {
+   public:
+    ReadableSource(uS::Loop* loop, int fd, std::function<void()> handler)
+        : uS::Poll(loop, fd), loop_(loop), handler_(std::move(handler)) {
+      setCb([](uS::Poll* poll, int status, int /*events*/) {
+        CHECK(status >= 0, "error on fd %d", poll->getFd());
+        static_cast<ReadableSource*>(poll)->handler_();
+      });
+      start(loop, this, UV_READABLE);
+    }
+
+    ~ReadableSource() {
+      if (watched_) {
+        stop(loop_);
+      }
+    }
+
+    void watch(bool watched) {
+      if (watched == watched_) {
+        return;
+      }
+      if (watched) {
+        start(loop_, this, UV_READABLE);
+      } else {
+        stop(loop_);
+      }
+      watched_ = watched;
+    }
+
+   private:
+    uS::Loop* const loop_;
+    const std::function<void()> handler_;
+    bool watched_ = true;
+  };
+
+  // With the epoll backend the loop ends each batch itself.
+  template <typename F>
+  std::function<void()> with_batch_end(const F& handler) {
+#ifdef USE_EPOLL
+    return handler;
+#else
+    return [this, handler]() {
+      handler();
+      end_batch();
+    };
+#endif
+  }
+
+  uWS::Hub hub_;
+  // Whatever the loop called around each wakeup before us.
+  void (*next_pre_cb_)(void*) = nullptr;
+  void* next_pre_cb_data_ = nullptr;
+  void (*next_post_cb_)(void*) = nullptr;
+  void* next_post_cb_data_ = nullptr;
+  std::vector<std::function<void()>> on_wakeup_;
+  std::vector<std::function<void()>> on_batch_end_;
+  std::vector<std::unique_ptr<Timer>> timers_;
+  std::vector<std::unique_ptr<ReadableSource>> sources_;
+};
+
+}  // namespace opentoken
+
+#endif  // _OPENTOKEN__HARE__EVENT_LOOP_H_
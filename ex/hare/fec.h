@@ -0,0 +1,153 @@
+#ifndef _OPENTOKEN__HARE__FEC_H_
+#define _OPENTOKEN__HARE__FEC_H_
+
+#include "check.h"
+#include "sequence.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace opentoken {
+
+// Largest number of datagrams one parity datagram may cover.
+constexpr size_t kMaxParityGroupSize = 64;
+
+// Starts the payload of a parity datagram and is followed by the XOR of the
+// datagrams it covers, each zero padded to the longest of them.
+struct ParityRecord {
+  // XOR of the sizes of the covered datagrams.
+  uint32_t size_xor;
+  uint32_t reserved;
+};
+
+namespace {
+
+void xor_bytes(uint8_t* out, const uint8_t* in, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    out[i] ^= in[i];
+  }
+}
+
+}  // namespace
+
+// Accumulates the parity of a group of datagrams of up to
+// |max_datagram_size| bytes each, header and signature included. Any one of
+// them can be rebuilt from the parity and the others.
+class ParityEncoder final {
+ public:
+  explicit ParityEncoder(size_t max_datagram_size)
+      : parity_(max_datagram_size) {}
+
+  void add(const uint8_t* data, size_t size) {
+    CHECK(size <= parity_.size(), "%zu byte datagram", size);
+    xor_bytes(parity_.data(), data, size);
+    size_xor_ ^= static_cast<uint32_t>(size);
+    parity_size_ = std::max(parity_size_, size);
+    ++count_;
+  }
+
+  size_t max_datagram_size() const { return parity_.size(); }
+  // Datagrams added since the last finish().
+  size_t count() const { return count_; }
+
+  // Writes the ParityRecord and parity of the datagrams added so far to
+  // |out|, which must have room for sizeof(ParityRecord) plus the largest
+  // datagram, and starts a new group. Returns the bytes written.
+  size_t finish(uint8_t* out) {
+    const ParityRecord record{size_xor_, 0};
+    std::memcpy(out, &record, sizeof(record));
+    std::memcpy(out + sizeof(record), parity_.data(), parity_size_);
+    const size_t size = sizeof(record) + parity_size_;
+    std::fill(parity_.begin(), parity_.begin() + parity_size_, 0);
+    size_xor_ = 0;
+    parity_size_ = 0;
+    count_ = 0;
+    return size;
+  }
+
+ private:
+  ParityEncoder(ParityEncoder&) = delete;
+  ParityEncoder(ParityEncoder&&) = delete;
+
+  std::vector<uint8_t> parity_;
+  uint32_t size_xor_ = 0;
+  size_t parity_size_ = 0;
+  size_t count_ = 0;
+};
+
+// Keeps the last datagrams received from one sender by sequence, to rebuild
+// a lost one when the parity of its group arrives.
+class ParityDecoder final {
+ public:
+  explicit ParityDecoder(size_t max_datagram_size)
+      : received_(2 * kMaxParityGroupSize, max_datagram_size),
+        repair_(max_datagram_size) {}
+
+  void add(uint64_t sequence, const uint8_t* data, size_t size) {
+    received_.store(sequence, data, size);
+  }
+
+  // Given the parity |payload| of the |count| datagrams from |first|,
+  // rebuilds the one of them that was not added. Returns it, or a null
+  // iovec when none or several are missing. The datagram still has to be
+  // verified, and is only valid until the next call.
+  iovec repair(uint64_t first, size_t count, const uint8_t* payload,
+               size_t size) {
+    if (count > kMaxParityGroupSize || size < sizeof(ParityRecord) ||
+        size - sizeof(ParityRecord) > repair_.size()) {
+      fprintf(stderr, "bad parity for %zu packets from %llu\n", count,
+              static_cast<unsigned long long>(first));
+      return iovec{nullptr, 0};
+    }
+
+    size_t num_missing = 0;
+    for (uint64_t sequence = first; sequence < first + count; ++sequence) {
+      if (!received_.find(sequence).iov_base) {
+        ++num_missing;
+      }
+    }
+    if (num_missing != 1) {
+      unrecoverable_ += num_missing;
+      return iovec{nullptr, 0};
+    }
+
+    ParityRecord record;
+    std::memcpy(&record, payload, sizeof(record));
+    const size_t parity_size = size - sizeof(ParityRecord);
+    std::memcpy(repair_.data(), payload + sizeof(record), parity_size);
+    size_t repaired_size = record.size_xor;
+    for (uint64_t sequence = first; sequence < first + count; ++sequence) {
+      const iovec datagram = received_.find(sequence);
+      if (datagram.iov_base && datagram.iov_len <= parity_size) {
+        xor_bytes(repair_.data(), static_cast<uint8_t*>(datagram.iov_base),
+                  datagram.iov_len);
+        repaired_size ^= datagram.iov_len;
+      }
+    }
+    if (repaired_size > parity_size) {
+      ++unrecoverable_;
+      return iovec{nullptr, 0};
+    }
+    ++repaired_;
+    return iovec{repair_.data(), repaired_size};
+  }
+
+  uint64_t repaired() const { return repaired_; }
+  uint64_t unrecoverable() const { return unrecoverable_; }
+
+ private:
+  ParityDecoder(ParityDecoder&) = delete;
+  ParityDecoder(ParityDecoder&&) = delete;
+
+  RetransmitRing received_;
+  std::vector<uint8_t> repair_;
+  uint64_t repaired_ = 0;
+  uint64_t unrecoverable_ = 0;
+};
+
+}  // namespace opentoken
+
+#endif  // _OPENTOKEN__HARE__FEC_H_
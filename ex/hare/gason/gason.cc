@@ -1,8 +1,21 @@
 #include "gason.h"
 #include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) && !defined(JSON_NO_SIMD)
+#include <immintrin.h>
+#endif
 
 #define JSON_ZONE_SIZE 4096
 #define JSON_STACK_SIZE 32
+// Most tokens jsonParse indexes ahead; longer documents are parsed a byte
+// at a time.
+#define JSON_INDEX_SIZE 4096
+// Documents shorter than JSON_INDEX_MIN_SIZE bytes, or with more than one
+// token every JSON_INDEX_SPAN bytes, such as compact messages of short
+// fields, are parsed a byte at a time too: the index saves less than it
+// costs to build.
+#define JSON_INDEX_MIN_SIZE 256
+#define JSON_INDEX_SPAN 4
 
 
 namespace gason {
@@ -73,50 +86,11 @@ static inline int char2int(char c) {
     return (c & ~' ') - 'A' + 10;
 }
 
-static double string2double(char *s, char **endptr) {
-    char ch = *s;
-    if (ch == '-')
-        ++s;
-
+static double string2double(char *s, const char *end, char **endptr) {
     double result = 0;
-    while (isdigit(*s))
-        result = (result * 10) + (*s++ - '0');
-
-    if (*s == '.') {
-        ++s;
-
-        double fraction = 1;
-        while (isdigit(*s)) {
-            fraction *= 0.1;
-            result += (*s++ - '0') * fraction;
-        }
-    }
-
-    if (*s == 'e' || *s == 'E') {
-        ++s;
-
-        double base = 10;
-        if (*s == '+')
-            ++s;
-        else if (*s == '-') {
-            ++s;
-            base = 0.1;
-        }
-
-        unsigned int exponent = 0;
-        while (isdigit(*s))
-            exponent = (exponent * 10) + (*s++ - '0');
-
-        double power = 1;
-        for (; exponent; exponent >>= 1, base *= base)
-            if (exponent & 1)
-                power *= base;
-
-        result *= power;
-    }
-
-    *endptr = s;
-    return ch == '-' ? -result : result;
+    const char *number_end = opentoken::parse_decimal(s, end, &result);
+    *endptr = number_end ? (char *)number_end : s;
+    return result;
 }
 
 static inline JsonNode *insertAfter(JsonNode *tail, JsonNode *node) {
@@ -136,7 +110,291 @@ static inline JsonValue listToValue(JsonTag tag, JsonNode *tail) {
     return JsonValue(tag, nullptr);
 }
 
-JsonErrno jsonParse(char *s, char **endptr, JsonValue *value, JsonAllocator &allocator) {
+// The byte at |s|, or NUL at the end of the document, which need not be
+// terminated.
+static inline char at(const char *s, const char *end) {
+    return s < end ? *s : 0;
+}
+
+// Stage 1: finds where the tokens of a document start, 64 bytes at a time,
+// so that parse() jumps from one to the next instead of looking at every
+// byte. The index holds structural characters outside strings, both quotes
+// of each string, and the first byte of each number or literal. Documents
+// with backslashes, control characters in strings, unclosed strings or too
+// many tokens are not indexed, and go a byte at a time.
+
+// Bit i of each mask is set if byte i of the block is of the class. Blocks
+// are classified with AVX2 or SSE2 on x86-64, and a byte at a time
+// elsewhere or with JSON_NO_SIMD defined.
+struct BlockMasks {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t structural;
+    uint64_t space;
+    uint64_t control;
+};
+
+#if defined(__x86_64__) && !defined(JSON_NO_SIMD)
+static inline uint64_t movemask16(__m128i x, int shift) {
+    return (uint64_t)(uint16_t)_mm_movemask_epi8(x) << shift;
+}
+
+static void classifySse2(const char *block, BlockMasks *m) {
+    *m = BlockMasks{};
+    for (int i = 0; i < 64; i += 16) {
+        const __m128i x = _mm_loadu_si128((const __m128i *)(block + i));
+        const auto eq = [x](char c) { return _mm_cmpeq_epi8(x, _mm_set1_epi8(c)); };
+        const __m128i structural =
+            _mm_or_si128(_mm_or_si128(_mm_or_si128(eq('{'), eq('}')), _mm_or_si128(eq('['), eq(']'))),
+                         _mm_or_si128(eq(':'), eq(',')));
+        // Unsigned c - 9 <= 4 is \t to \r, unsigned c <= 31 a control.
+        const __m128i tab = _mm_sub_epi8(x, _mm_set1_epi8('\t'));
+        const __m128i space =
+            _mm_or_si128(eq(' '), _mm_cmpeq_epi8(_mm_min_epu8(tab, _mm_set1_epi8(4)), tab));
+        const __m128i control =
+            _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(0x1F)), x), eq(0x7F));
+        m->quote |= movemask16(eq('"'), i);
+        m->backslash |= movemask16(eq('\\'), i);
+        m->structural |= movemask16(structural, i);
+        m->space |= movemask16(space, i);
+        m->control |= movemask16(control, i);
+    }
+}
+
+__attribute__((target("avx2"))) static inline uint64_t movemask32(__m256i x, int shift) {
+    return (uint64_t)(uint32_t)_mm256_movemask_epi8(x) << shift;
+}
+
+__attribute__((target("avx2"))) static void classifyAvx2(const char *block, BlockMasks *m) {
+    *m = BlockMasks{};
+    for (int i = 0; i < 64; i += 32) {
+        const __m256i x = _mm256_loadu_si256((const __m256i *)(block + i));
+        const auto eq = [x](char c) __attribute__((target("avx2"))) {
+            return _mm256_cmpeq_epi8(x, _mm256_set1_epi8(c));
+        };
+        const __m256i structural = _mm256_or_si256(
+            _mm256_or_si256(_mm256_or_si256(eq('{'), eq('}')), _mm256_or_si256(eq('['), eq(']'))),
+            _mm256_or_si256(eq(':'), eq(',')));
+        const __m256i tab = _mm256_sub_epi8(x, _mm256_set1_epi8('\t'));
+        const __m256i space = _mm256_or_si256(
+            eq(' '), _mm256_cmpeq_epi8(_mm256_min_epu8(tab, _mm256_set1_epi8(4)), tab));
+        const __m256i control = _mm256_or_si256(
+            _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(0x1F)), x), eq(0x7F));
+        m->quote |= movemask32(eq('"'), i);
+        m->backslash |= movemask32(eq('\\'), i);
+        m->structural |= movemask32(structural, i);
+        m->space |= movemask32(space, i);
+        m->control |= movemask32(control, i);
+    }
+}
+
+static void classify(const char *block, BlockMasks *m) {
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2)
+        classifyAvx2(block, m);
+    else
+        classifySse2(block, m);
+}
+#else
+static void classify(const char *block, BlockMasks *m) {
+    *m = BlockMasks{};
+    for (int i = 0; i < 64; ++i) {
+        const unsigned char c = block[i];
+        const uint64_t bit = 1ULL << i;
+        if (c == '"')
+            m->quote |= bit;
+        else if (c == '\\')
+            m->backslash |= bit;
+        else if (c == '{' || c == '}' || c == '[' || c == ']' || c == ':' || c == ',')
+            m->structural |= bit;
+        if (c == ' ' || (c >= '\t' && c <= '\r'))
+            m->space |= bit;
+        if (c < ' ' || c == 0x7F)
+            m->control |= bit;
+    }
+}
+#endif
+
+// Bit i of the result is the parity of bits 0 to i of |x|.
+static inline uint64_t prefixXor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+struct IndexedTokens {
+    char *base;
+    // Room for the whole last block, as build() writes eight entries at a
+    // time.
+    uint32_t index[JSON_INDEX_SIZE + 64];
+    uint32_t count = 0;
+    uint32_t next_token = 0;
+
+    // Returns false if the |size| bytes at |s| cannot be indexed.
+    bool build(char *s, size_t size) {
+        base = s;
+        if (size > UINT32_MAX)
+            return false;
+        // Whether the previous block ended inside a string, or on a byte
+        // after which a number or literal may start.
+        uint64_t in_string = 0;
+        uint64_t after_separator = 1;
+        char tail[64];
+        for (size_t offset = 0; offset < size; offset += 64) {
+            const char *block = s + offset;
+            if (size - offset < 64) {
+                memset(tail, ' ', sizeof(tail));
+                memcpy(tail, block, size - offset);
+                block = tail;
+            }
+            BlockMasks m;
+            classify(block, &m);
+            if (m.backslash)
+                return false;
+            // Set from each opening quote up to, not including, its closing
+            // quote.
+            const uint64_t string = prefixXor(m.quote) ^ in_string;
+            in_string = (uint64_t)((int64_t)string >> 63);
+            if (m.control & string)
+                return false;
+            const uint64_t structural = m.structural & ~string;
+            const uint64_t separator = structural | (m.space & ~string);
+            const uint64_t scalar =
+                ~(separator | m.quote | string) & (separator << 1 | after_separator);
+            after_separator = separator >> 63;
+
+            uint64_t tokens = structural | m.quote | scalar;
+            const uint32_t n = (uint32_t)__builtin_popcountll(tokens);
+            if (count + n > JSON_INDEX_SIZE || (count + n) * JSON_INDEX_SPAN > offset + 64)
+                return false;
+            // Unconditional writes past the last token are overwritten by
+            // the next block, and are cheaper than a branch per token.
+            for (uint32_t *out = index + count; tokens; out += 8) {
+                for (int i = 0; i < 8; ++i) {
+                    out[i] = (uint32_t)offset + (uint32_t)__builtin_ctzll(tokens | 1ULL << 63);
+                    tokens &= tokens - 1;
+                }
+            }
+            count += n;
+        }
+        return !in_string;
+    }
+
+    bool next(char **s) {
+        if (next_token == count)
+            return false;
+        *s = base + index[next_token++];
+        return true;
+    }
+
+    // Moves |s| from the opening quote of a string past its closing quote,
+    // which becomes the end of the string.
+    JsonErrno string(char **s, char **) {
+        char *close = base + index[next_token++];
+        *close = 0;
+        *s = close + 1;
+        return JsonErrno::JSON_OK;
+    }
+
+    // Undoes string() so that the document can be parsed again. The only
+    // NULs before the end are closing quotes string() replaced.
+    void restoreStrings() {
+        for (uint32_t i = 0; i < next_token; ++i) {
+            if (!base[index[i]])
+                base[index[i]] = '"';
+        }
+    }
+};
+
+struct BytewiseTokens {
+    // The end of the document, or its terminating NUL if that comes first.
+    const char *end;
+
+    // Skips whitespace to the next token. Stops at the end rather than
+    // reading past it when only whitespace is left.
+    bool next(char **s) {
+        while (*s < end && isspace(**s))
+            ++*s;
+        return at(*s, end) != 0;
+    }
+
+    // Moves |s| from the opening quote of a string past its closing quote,
+    // unescaping it in place.
+    JsonErrno string(char **ps, char **endptr) {
+        char *s = *ps;
+        for (char *it = s; at(s, end); ++it, ++s) {
+            int c = *it = *s;
+            if (c == '\\') {
+                c = at(++s, end);
+                switch (c) {
+                case '\\':
+                case '"':
+                case '/':
+                    *it = c;
+                    break;
+                case 'b':
+                    *it = '\b';
+                    break;
+                case 'f':
+                    *it = '\f';
+                    break;
+                case 'n':
+                    *it = '\n';
+                    break;
+                case 'r':
+                    *it = '\r';
+                    break;
+                case 't':
+                    *it = '\t';
+                    break;
+                case 'u':
+                    c = 0;
+                    for (int i = 0; i < 4; ++i) {
+                        if (isxdigit(at(++s, end))) {
+                            c = c * 16 + char2int(*s);
+                        } else {
+                            *endptr = s;
+                            return JsonErrno::JSON_BAD_STRING;
+                        }
+                    }
+                    if (c < 0x80) {
+                        *it = c;
+                    } else if (c < 0x800) {
+                        *it++ = 0xC0 | (c >> 6);
+                        *it = 0x80 | (c & 0x3F);
+                    } else {
+                        *it++ = 0xE0 | (c >> 12);
+                        *it++ = 0x80 | ((c >> 6) & 0x3F);
+                        *it = 0x80 | (c & 0x3F);
+                    }
+                    break;
+                default:
+                    *endptr = s;
+                    return JsonErrno::JSON_BAD_STRING;
+                }
+            } else if ((unsigned int)c < ' ' || c == '\x7F') {
+                *endptr = s;
+                return JsonErrno::JSON_BAD_STRING;
+            } else if (c == '"') {
+                *it = 0;
+                ++s;
+                break;
+            }
+        }
+        *ps = s;
+        return JsonErrno::JSON_OK;
+    }
+};
+
+// Stage 2: builds the tree from the tokens of |s|, reading nothing at or
+// past |end|.
+template <typename Tokens>
+static JsonErrno parse(char *s, const char *end, char **endptr, JsonValue *value, JsonAllocator &allocator,
+                       Tokens &tokens) {
     JsonNode *tails[JSON_STACK_SIZE];
     JsonTag tags[JSON_STACK_SIZE];
     char *keys[JSON_STACK_SIZE];
@@ -146,15 +404,11 @@ JsonErrno jsonParse(char *s, char **endptr, JsonValue *value, JsonAllocator &all
     JsonNode *node;
     *endptr = s;
 
-    while (*s) {
-        while (isspace(*s)) {
-            ++s;
-            if (!*s) break;
-        }
+    while (tokens.next(&s)) {
         *endptr = s++;
         switch (**endptr) {
         case '-':
-            if (!isdigit(*s) && *s != '.') {
+            if (!isdigit(at(s, end)) && at(s, end) != '.') {
                 *endptr = s;
                 return JsonErrno::JSON_BAD_NUMBER;
             }
@@ -168,92 +422,40 @@ JsonErrno jsonParse(char *s, char **endptr, JsonValue *value, JsonAllocator &all
         case '7':
         case '8':
         case '9':
-            o = JsonValue(string2double(*endptr, &s));
-            if (!isdelim(*s)) {
+            o = JsonValue(string2double(*endptr, end, &s));
+            if (!isdelim(at(s, end))) {
                 *endptr = s;
                 return JsonErrno::JSON_BAD_NUMBER;
             }
             break;
-        case '"':
+        case '"': {
             o = JsonValue(JsonTag::JSON_STRING, s);
-            for (char *it = s; *s; ++it, ++s) {
-                int c = *it = *s;
-                if (c == '\\') {
-                    c = *++s;
-                    switch (c) {
-                    case '\\':
-                    case '"':
-                    case '/':
-                        *it = c;
-                        break;
-                    case 'b':
-                        *it = '\b';
-                        break;
-                    case 'f':
-                        *it = '\f';
-                        break;
-                    case 'n':
-                        *it = '\n';
-                        break;
-                    case 'r':
-                        *it = '\r';
-                        break;
-                    case 't':
-                        *it = '\t';
-                        break;
-                    case 'u':
-                        c = 0;
-                        for (int i = 0; i < 4; ++i) {
-                            if (isxdigit(*++s)) {
-                                c = c * 16 + char2int(*s);
-                            } else {
-                                *endptr = s;
-                                return JsonErrno::JSON_BAD_STRING;
-                            }
-                        }
-                        if (c < 0x80) {
-                            *it = c;
-                        } else if (c < 0x800) {
-                            *it++ = 0xC0 | (c >> 6);
-                            *it = 0x80 | (c & 0x3F);
-                        } else {
-                            *it++ = 0xE0 | (c >> 12);
-                            *it++ = 0x80 | ((c >> 6) & 0x3F);
-                            *it = 0x80 | (c & 0x3F);
-                        }
-                        break;
-                    default:
-                        *endptr = s;
-                        return JsonErrno::JSON_BAD_STRING;
-                    }
-                } else if ((unsigned int)c < ' ' || c == '\x7F') {
-                    *endptr = s;
-                    return JsonErrno::JSON_BAD_STRING;
-                } else if (c == '"') {
-                    *it = 0;
-                    ++s;
-                    break;
-                }
-            }
-            if (!isdelim(*s)) {
+            const JsonErrno err = tokens.string(&s, endptr);
+            if (err != JsonErrno::JSON_OK)
+                return err;
+            if (!isdelim(at(s, end))) {
                 *endptr = s;
                 return JsonErrno::JSON_BAD_STRING;
             }
             break;
+        }
         case 't':
-            if (!(s[0] == 'r' && s[1] == 'u' && s[2] == 'e' && isdelim(s[3])))
+            if (!(at(s, end) == 'r' && at(s + 1, end) == 'u' && at(s + 2, end) == 'e' &&
+                  isdelim(at(s + 3, end))))
                 return JsonErrno::JSON_BAD_IDENTIFIER;
             o = JsonValue(JsonTag::JSON_TRUE);
             s += 3;
             break;
         case 'f':
-            if (!(s[0] == 'a' && s[1] == 'l' && s[2] == 's' && s[3] == 'e' && isdelim(s[4])))
+            if (!(at(s, end) == 'a' && at(s + 1, end) == 'l' && at(s + 2, end) == 's' &&
+                  at(s + 3, end) == 'e' && isdelim(at(s + 4, end))))
                 return JsonErrno::JSON_BAD_IDENTIFIER;
             o = JsonValue(JsonTag::JSON_FALSE);
             s += 4;
             break;
         case 'n':
-            if (!(s[0] == 'u' && s[1] == 'l' && s[2] == 'l' && isdelim(s[3])))
+            if (!(at(s, end) == 'u' && at(s + 1, end) == 'l' && at(s + 2, end) == 'l' &&
+                  isdelim(at(s + 3, end))))
                 return JsonErrno::JSON_BAD_IDENTIFIER;
             o = JsonValue(JsonTag::JSON_NULL);
             s += 3;
@@ -335,4 +537,31 @@ JsonErrno jsonParse(char *s, char **endptr, JsonValue *value, JsonAllocator &all
     }
     return JsonErrno::JSON_BREAKING_BAD;
 }
+
+// Parses the |size| bytes at |s| through an index, leaving them as they
+// were if that fails. Kept out of line so that short documents do not pay
+// for the index on the stack.
+static __attribute__((noinline)) bool parseIndexed(char *s, size_t size, char **endptr, JsonValue *value,
+                                                   JsonAllocator &allocator) {
+    IndexedTokens indexed;
+    if (!indexed.build(s, size))
+        return false;
+    if (parse(s, s + size, endptr, value, allocator, indexed) == JsonErrno::JSON_OK)
+        return true;
+    indexed.restoreStrings();
+    return false;
+}
+
+JsonErrno jsonParse(char *s, size_t size, char **endptr, JsonValue *value, JsonAllocator &allocator) {
+    if (size >= JSON_INDEX_MIN_SIZE && parseIndexed(s, size, endptr, value, allocator))
+        return JsonErrno::JSON_OK;
+    // Errors are reported by the byte at a time parser, which also says
+    // where they are.
+    BytewiseTokens bytewise{s + size};
+    return parse(s, s + size, endptr, value, allocator, bytewise);
+}
+
+JsonErrno jsonParse(char *s, char **endptr, JsonValue *value, JsonAllocator &allocator) {
+    return jsonParse(s, strlen(s), endptr, value, allocator);
+}
 }  //  namespace
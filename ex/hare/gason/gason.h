@@ -1,6 +1,7 @@
 #pragma once
 
 #include "../check.h"
+#include "../decimal.h"
 
 #include <cassert>
 #include <cstddef>
@@ -64,7 +65,10 @@ union JsonValue {
     if (getTag() == JsonTag::JSON_NUMBER) {
       return toNumber();
     } else if (getTag() == JsonTag::JSON_STRING) {
-      return std::atof(toString());
+      double result;
+      const char *end = opentoken::parse_decimal(toString(), &result);
+      // Whatever else atof makes of it, such as leading spaces or "inf".
+      return end && !*end ? result : std::atof(toString());
     } else {
       FAIL("Bad tag %d", getTag());
     }
@@ -137,6 +141,11 @@ class JsonAllocator {
   void deallocate();
 };
 
+// Parses the |size| bytes at |str|, which need not be terminated, in
+// place. Nothing past them is read.
+JsonErrno jsonParse(char *str, size_t size, char **endptr, JsonValue *value,
+                    JsonAllocator &allocator);
+// Parses the NUL terminated |str| in place.
 JsonErrno jsonParse(char *str, char **endptr, JsonValue *value,
                     JsonAllocator &allocator);
 
@@ -2,34 +2,350 @@
 #define _OPENTOKEN__HARE__HASHER_H_
 
 #include "check.h"
+#include "mac.h"
+#include "sha256_batch.h"
 
-#include <openssl/engine.h>
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
+#include <openssl/sha.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/engine.h>
 #include <openssl/hmac.h>
+#endif
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 namespace opentoken {
 
-constexpr size_t kMaxPrecomputed = 3;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+// OpenSSL before 1.1 must be given locks before it is used from several
+// threads.
+static inline void init_openssl_threading() {
+  static std::vector<std::mutex> locks(static_cast<size_t>(CRYPTO_num_locks()));
+  CRYPTO_set_locking_callback([](int mode, int n, const char *, int) {
+    if (mode & CRYPTO_LOCK) {
+      locks[static_cast<size_t>(n)].lock();
+    } else {
+      locks[static_cast<size_t>(n)].unlock();
+    }
+  });
+}
+#else
+static inline void init_openssl_threading() {}
+#endif
+
 constexpr size_t kHashSizeBytes = 32;
 
+// HMAC-SHA256 keyed with the secret itself, what hare always signed with.
+// Single messages go through OpenSSL, batches through HmacSha256Batch when
+// the CPU accelerates it.
+class HmacSha256Mac final : public MacBackend {
+ public:
+  explicit HmacSha256Mac(const std::string& key)
+      : batch_(reinterpret_cast<const uint8_t*>(key.data()), key.size()) {
+    CHECK(!key.empty());
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    mac_ = CHECK_NOTNULL(EVP_MAC_fetch(nullptr, "HMAC", nullptr));
+    ctx_ = CHECK_NOTNULL(EVP_MAC_CTX_new(mac_));
+    char digest[] = "SHA256";
+    const OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+        OSSL_PARAM_construct_end()};
+    CHECK(EVP_MAC_init(ctx_, reinterpret_cast<const uint8_t*>(key.data()),
+                       key.size(), params) == 1);
+#else
+    ENGINE_load_builtin_engines();
+    ENGINE_register_all_complete();
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    ctx_ = CHECK_NOTNULL(HMAC_CTX_new());
+#else
+    ctx_ = &ctx_storage_;
+    HMAC_CTX_init(ctx_);
+#endif
+    CHECK(HMAC_Init_ex(ctx_, key.data(), static_cast<int>(key.size()),
+                       EVP_sha256(), nullptr) == 1);
+#endif
+  }
+
+  ~HmacSha256Mac() {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_MAC_CTX_free(ctx_);
+    EVP_MAC_free(mac_);
+#elif OPENSSL_VERSION_NUMBER >= 0x10100000L
+    HMAC_CTX_free(ctx_);
+#else
+    HMAC_CTX_cleanup(ctx_);
+#endif
+  }
+
+  size_t tag_size() const override { return kTagSize; }
+
+  // Restarts from the keyed state each time instead of rehashing the key.
+  void mac(const uint8_t* input, size_t size, uint8_t* tag) override {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    CHECK(EVP_MAC_init(ctx_, nullptr, 0, nullptr) == 1);
+    CHECK(EVP_MAC_update(ctx_, input, size) == 1);
+    size_t len;
+    CHECK(EVP_MAC_final(ctx_, tag, &len, kTagSize) == 1);
+#else
+    CHECK(HMAC_Init_ex(ctx_, nullptr, 0, nullptr, nullptr) == 1);
+    CHECK(HMAC_Update(ctx_, input, size) == 1);
+    unsigned len;
+    CHECK(HMAC_Final(ctx_, tag, &len) == 1);
+#endif
+    CHECK(len == kTagSize, "len was %u", static_cast<unsigned>(len));
+  }
+
+  void mac_batch(const uint8_t* const* inputs, const size_t* sizes,
+                 size_t count, uint8_t* const* tags) override {
+    if (count > 1 && batch_.impl() != HmacSha256Batch::Impl::Portable) {
+      batch_.mac_batch(inputs, sizes, count, tags);
+    } else {
+      MacBackend::mac_batch(inputs, sizes, count, tags);
+    }
+  }
+
+ private:
+  HmacSha256Mac(HmacSha256Mac&) = delete;
+  HmacSha256Mac(HmacSha256Mac&&) = delete;
+
+  constexpr static size_t kTagSize = 32;
+  static_assert(kTagSize == HmacSha256Batch::kTagSize, "tag sizes differ");
+
+  const HmacSha256Batch batch_;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  EVP_MAC* mac_;
+  EVP_MAC_CTX* ctx_;
+#else
+  HMAC_CTX* ctx_;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  HMAC_CTX ctx_storage_;
+#endif
+#endif
+};
+
+// How datagrams are signed. Senders and receivers must agree.
+enum class MacAlgorithm : uint8_t {
+  HmacSha256,
+  SipHash128,
+  Blake2s,
+};
+
+constexpr MacAlgorithm kMacAlgorithms[] = {
+    MacAlgorithm::HmacSha256, MacAlgorithm::SipHash128, MacAlgorithm::Blake2s};
+
+static inline const char* mac_algorithm_name(MacAlgorithm algorithm) {
+  switch (algorithm) {
+    case MacAlgorithm::HmacSha256:
+      return "hmac-sha256";
+    case MacAlgorithm::SipHash128:
+      return "siphash";
+    case MacAlgorithm::Blake2s:
+      return "blake2s";
+  }
+  return "unknown";
+}
+
+// Makes the backend for |algorithm|. All but HMAC-SHA256 take a fixed size
+// key, derived from |key| with SHA-256.
+static inline std::unique_ptr<MacBackend> make_mac_backend(
+    const std::string& key, MacAlgorithm algorithm) {
+  CHECK(!key.empty());
+  uint8_t derived[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const uint8_t*>(key.data()), key.size(), derived);
+  static_assert(sizeof(derived) >= SipHash128Mac::kKeySize &&
+                    sizeof(derived) >= Blake2sMac::kKeySize,
+                "derived key too short");
+  switch (algorithm) {
+    case MacAlgorithm::HmacSha256:
+      return std::unique_ptr<MacBackend>{new HmacSha256Mac{key}};
+    case MacAlgorithm::SipHash128:
+      return std::unique_ptr<MacBackend>{new SipHash128Mac{derived}};
+    case MacAlgorithm::Blake2s:
+      return std::unique_ptr<MacBackend>{new Blake2sMac{derived}};
+  }
+  FAIL("unknown MAC algorithm %d", static_cast<int>(algorithm));
+}
+
+// The MAC named by HARE_MAC: hmac-sha256 (the default), siphash for
+// SipHash-2-4 with a 128 bit tag, or blake2s.
+static inline MacAlgorithm getenv_mac_algorithm() {
+  const char* name = getenv("HARE_MAC");
+  if (!name || !*name) {
+    return MacAlgorithm::HmacSha256;
+  }
+  for (const auto algorithm : kMacAlgorithms) {
+    if (str_eq(name, mac_algorithm_name(algorithm))) {
+      return algorithm;
+    }
+  }
+  FAIL("unknown HARE_MAC \"%s\"", name);
+}
+
+// Writes the tag of |input| to |output|, padded with zeros to
+// kHashSizeBytes so the wire format is the same for every algorithm.
+static inline void sign(MacBackend* backend, const uint8_t* input,
+                        size_t size, uint8_t output[kHashSizeBytes]) {
+  backend->mac(input, size, output);
+  const size_t tag_size = backend->tag_size();
+  if (tag_size < kHashSizeBytes) {
+    std::memset(output + tag_size, 0, kHashSizeBytes - tag_size);
+  }
+}
+
+// Signatures of the |window| ids from the last one looked up onwards,
+// computed ahead on a thread of its own with |backend|. Looking one up is
+// then a copy. Lookups must all come from one thread.
+//
+// Each slot is a seqlock: the thread marks it invalid, writes the tag and
+// publishes the id, and a lookup only counts if it saw the same id before
+// and after copying.
+class IdSignatureCache final {
+ public:
+  IdSignatureCache(std::unique_ptr<MacBackend> backend, size_t window)
+      : backend_(std::move(backend)), window_(window) {
+    CHECK(window > 0, "empty signature cache");
+    size_t capacity = 1;
+    while (capacity < window) {
+      capacity *= 2;
+    }
+    slots_.reset(new Slot[capacity]);
+    mask_ = capacity - 1;
+    thread_ = std::thread([this]() { run(); });
+  }
+
+  ~IdSignatureCache() {
+    stopping_.store(true, std::memory_order_relaxed);
+    thread_.join();
+  }
+
+  // Copies the signature of |id| to |output| if it is ready.
+  bool find(uint64_t id, uint8_t output[kHashSizeBytes]) {
+    next_id_.store(id + 1, std::memory_order_relaxed);
+    const Slot& slot = slots_[id & mask_];
+    if (slot.id.load(std::memory_order_acquire) == id) {
+      std::memcpy(output, slot.tag, kHashSizeBytes);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.id.load(std::memory_order_relaxed) == id) {
+        ++hits_;
+        return true;
+      }
+    }
+    ++misses_;
+    return false;
+  }
+
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+
+  // Writes lookups since the last report. Call from the looking up thread.
+  void report(FILE* f) {
+    fprintf(f, "id signature cache: %llu hits, %llu misses, window %zu\n",
+            static_cast<unsigned long long>(hits_),
+            static_cast<unsigned long long>(misses_), window_);
+    hits_ = 0;
+    misses_ = 0;
+  }
+
+ private:
+  IdSignatureCache(IdSignatureCache&) = delete;
+  IdSignatureCache(IdSignatureCache&&) = delete;
+
+  constexpr static uint64_t kNoId = ~0ULL;
+  constexpr static auto kIdleSleep = std::chrono::microseconds(50);
+
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> id{kNoId};
+    uint8_t tag[kHashSizeBytes];
+  };
+
+  // Keeps the window ahead of the lookups, skipping ahead when they jump
+  // past it.
+  void run() {
+    uint64_t next = 0;
+    while (!stopping_.load(std::memory_order_relaxed)) {
+      const uint64_t wanted = next_id_.load(std::memory_order_relaxed);
+      if (next < wanted) {
+        next = wanted;
+      }
+      if (next - wanted >= window_) {
+        std::this_thread::sleep_for(kIdleSleep);
+        continue;
+      }
+      Slot& slot = slots_[next & mask_];
+      slot.id.store(kNoId, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      sign(backend_.get(), reinterpret_cast<const uint8_t*>(&next),
+           sizeof(next), slot.tag);
+      slot.id.store(next, std::memory_order_release);
+      ++next;
+    }
+  }
+
+  const std::unique_ptr<MacBackend> backend_;
+  const size_t window_;
+  std::unique_ptr<Slot[]> slots_;
+  size_t mask_;
+  std::atomic<bool> stopping_{false};
+  std::thread thread_;
+
+  // Written by the looking up thread.
+  alignas(64) std::atomic<uint64_t> next_id_{0};
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+};
+
+// Signs and checks datagrams with a keyed MAC, see sign().
 class Hasher final {
  public:
-  Hasher(std::string key) : base_ctx_(init_base_context(key)) {}
+  Hasher(std::string key, MacAlgorithm algorithm = getenv_mac_algorithm())
+      : key_(key),
+        algorithm_(algorithm),
+        backend_(make_mac_backend(key, algorithm)) {
+    CHECK(backend_->tag_size() <= kHashSizeBytes);
+  }
   Hasher(const char *key) : Hasher(std::string{CHECK_NOTNULL(key)}) {}
 
-  ~Hasher() { HMAC_CTX_cleanup(&base_ctx_); }
+  MacAlgorithm algorithm() const { return algorithm_; }
+
+  // Has hash(id) serve ids from a window of |window| signatures computed
+  // ahead of the last id asked for, on a thread of its own.
+  void enable_id_cache(size_t window) {
+    id_cache_.reset(
+        new IdSignatureCache{make_mac_backend(key_, algorithm_), window});
+  }
+
+  // nullptr unless enable_id_cache() was called.
+  IdSignatureCache *id_cache() { return id_cache_.get(); }
 
   void hash(const uint8_t *hash_input, size_t input_size,
             uint8_t output[kHashSizeBytes]) {
-    CHECK(HMAC_Init_ex(&base_ctx_, nullptr, 0, nullptr, nullptr) == 1);
-    CHECK(HMAC_Update(&base_ctx_, hash_input, input_size) == 1);
+    sign(backend_.get(), hash_input, input_size, output);
+  }
 
-    unsigned len;
-    CHECK(HMAC_Final(&base_ctx_, output, &len) == 1);
-    CHECK(len == kHashSizeBytes, "len was %u", len);
+  // hash() of the |sizes[i]| bytes at |inputs[i]| into |outputs[i]| for
+  // each i below |count|, several at once where the MAC allows.
+  void hash_batch(const uint8_t *const *inputs, const size_t *sizes,
+                  size_t count, uint8_t *const *outputs) {
+    backend_->mac_batch(inputs, sizes, count, outputs);
+    const size_t tag_size = backend_->tag_size();
+    if (tag_size < kHashSizeBytes) {
+      for (size_t i = 0; i < count; ++i) {
+        std::memset(outputs[i] + tag_size, 0, kHashSizeBytes - tag_size);
+      }
+    }
   }
 
   void hash(const char *hash_input, size_t input_size,
@@ -38,15 +354,8 @@ class Hasher final {
   }
 
   void hash(uint64_t id, uint8_t output[kHashSizeBytes]) {
-    if (id_offset_ <= id && id < id_offset_ + num_precomputed_) {
-      memcpy(output, precomputed_[id - id_offset_], kHashSizeBytes);
-    } else {
-      CHECK(HMAC_Init_ex(&base_ctx_, nullptr, 0, nullptr, nullptr) == 1);
-      CHECK(HMAC_Update(&base_ctx_, (uint8_t *)&id, sizeof(id)) == 1);
-
-      unsigned len;
-      CHECK(HMAC_Final(&base_ctx_, output, &len) == 1);
-      CHECK(len == kHashSizeBytes, "len was %u", len);
+    if (!id_cache_ || !id_cache_->find(id, output)) {
+      hash(reinterpret_cast<const uint8_t *>(&id), sizeof(id), output);
     }
   }
 
@@ -57,23 +366,32 @@ class Hasher final {
     return CRYPTO_memcmp(signature, computed_signature, kHashSizeBytes) == 0;
   }
 
- private:
-  HMAC_CTX base_ctx_;
-  uint64_t id_offset_ = 0;
-  uint8_t precomputed_[kMaxPrecomputed][kHashSizeBytes] = {};
-  size_t num_precomputed_ = 0;
-
-  static HMAC_CTX init_base_context(std::string key) {
-    CHECK(!key.empty());
-    ENGINE_load_builtin_engines();
-    ENGINE_register_all_complete();
-
-    HMAC_CTX ctx;
-    HMAC_CTX_init(&ctx);
-    CHECK(HMAC_Init_ex(&ctx, (void *)key.c_str(), (int)key.size(), EVP_sha256(),
-                       nullptr) == 1);
-    return ctx;
+  // is_valid_signature() of |count| messages into |valid|, with the
+  // signatures checked in one hash_batch().
+  void are_valid_signatures(const uint8_t *const *inputs, const size_t *sizes,
+                            const uint8_t *const *signatures, size_t count,
+                            bool *valid) {
+    if (computed_.size() < count) {
+      computed_.resize(count);
+      computed_ptrs_.resize(count);
+    }
+    for (size_t i = 0; i < count; ++i) {
+      computed_ptrs_[i] = computed_[i].data();
+    }
+    hash_batch(inputs, sizes, count, computed_ptrs_.data());
+    for (size_t i = 0; i < count; ++i) {
+      valid[i] = CRYPTO_memcmp(signatures[i], computed_[i].data(),
+                               kHashSizeBytes) == 0;
+    }
   }
+
+ private:
+  const std::string key_;
+  const MacAlgorithm algorithm_;
+  std::unique_ptr<MacBackend> backend_;
+  std::unique_ptr<IdSignatureCache> id_cache_;
+  std::vector<std::array<uint8_t, kHashSizeBytes>> computed_;
+  std::vector<uint8_t *> computed_ptrs_;
 };
 
 }  // namespace opentoken
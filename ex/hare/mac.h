@@ -0,0 +1,223 @@
+#ifndef _OPENTOKEN__HARE__MAC_H_
+#define _OPENTOKEN__HARE__MAC_H_
+
+#include "check.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace opentoken {
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+              "the MACs below load words in host order");
+
+// Computes a keyed tag over a message. Hasher holds one of these.
+class MacBackend {
+ public:
+  virtual ~MacBackend() = default;
+  // Bytes of tag written by mac().
+  virtual size_t tag_size() const = 0;
+  virtual void mac(const uint8_t* input, size_t size, uint8_t* tag) = 0;
+  // mac() of the |sizes[i]| bytes at |inputs[i]| into |tags[i]| for each i
+  // below |count|. Backends that can do several at once override this.
+  virtual void mac_batch(const uint8_t* const* inputs, const size_t* sizes,
+                         size_t count, uint8_t* const* tags) {
+    for (size_t i = 0; i < count; ++i) {
+      mac(inputs[i], sizes[i], tags[i]);
+    }
+  }
+};
+
+namespace {
+
+inline uint64_t rotl64(uint64_t x, unsigned bits) {
+  return x << bits | x >> (64 - bits);
+}
+
+inline uint32_t rotr32(uint32_t x, unsigned bits) {
+  return x >> bits | x << (32 - bits);
+}
+
+}  // namespace
+
+// SipHash-2-4 with a 128 bit tag, from "SipHash: a fast short-input PRF"
+// by Aumasson and Bernstein. About as strong as a 128 bit MAC gets for
+// short messages, at a fraction of the cost of SHA-256.
+class SipHash128Mac final : public MacBackend {
+ public:
+  constexpr static size_t kKeySize = 16;
+  constexpr static size_t kTagSize = 16;
+
+  explicit SipHash128Mac(const uint8_t key[kKeySize]) {
+    std::memcpy(&k0_, key, sizeof(k0_));
+    std::memcpy(&k1_, key + sizeof(k0_), sizeof(k1_));
+  }
+
+  size_t tag_size() const override { return kTagSize; }
+
+  void mac(const uint8_t* input, size_t size, uint8_t* tag) override {
+    uint64_t v[4] = {0x736f6d6570736575ULL ^ k0_,
+                     0x646f72616e646f6dULL ^ k1_ ^ 0xee,
+                     0x6c7967656e657261ULL ^ k0_,
+                     0x7465646279746573ULL ^ k1_};
+    const uint8_t* const end = input + (size & ~size_t{7});
+    for (; input != end; input += 8) {
+      uint64_t m;
+      std::memcpy(&m, input, sizeof(m));
+      v[3] ^= m;
+      round(v);
+      round(v);
+      v[0] ^= m;
+    }
+    uint64_t last = static_cast<uint64_t>(size) << 56;
+    for (size_t i = 0; i < (size & 7); ++i) {
+      last |= static_cast<uint64_t>(input[i]) << (8 * i);
+    }
+    v[3] ^= last;
+    round(v);
+    round(v);
+    v[0] ^= last;
+
+    v[2] ^= 0xee;
+    for (int i = 0; i < 4; ++i) {
+      round(v);
+    }
+    const uint64_t low = v[0] ^ v[1] ^ v[2] ^ v[3];
+    v[1] ^= 0xdd;
+    for (int i = 0; i < 4; ++i) {
+      round(v);
+    }
+    const uint64_t high = v[0] ^ v[1] ^ v[2] ^ v[3];
+    std::memcpy(tag, &low, sizeof(low));
+    std::memcpy(tag + sizeof(low), &high, sizeof(high));
+  }
+
+ private:
+  static void round(uint64_t* v) {
+    v[0] += v[1];
+    v[1] = rotl64(v[1], 13);
+    v[1] ^= v[0];
+    v[0] = rotl64(v[0], 32);
+    v[2] += v[3];
+    v[3] = rotl64(v[3], 16);
+    v[3] ^= v[2];
+    v[0] += v[3];
+    v[3] = rotl64(v[3], 21);
+    v[3] ^= v[0];
+    v[2] += v[1];
+    v[1] = rotl64(v[1], 17);
+    v[1] ^= v[2];
+    v[2] = rotl64(v[2], 32);
+  }
+
+  uint64_t k0_;
+  uint64_t k1_;
+};
+
+// BLAKE2s (RFC 7693) in keyed mode with a 256 bit tag. The block holding
+// the key is compressed once up front, so a message of up to 64 bytes
+// costs a single compression.
+class Blake2sMac final : public MacBackend {
+ public:
+  constexpr static size_t kKeySize = 32;
+  constexpr static size_t kTagSize = 32;
+
+  explicit Blake2sMac(const uint8_t key[kKeySize]) {
+    std::memcpy(initial_, kIV, sizeof(initial_));
+    initial_[0] ^= 0x01010000u ^ static_cast<uint32_t>(kKeySize << 8) ^
+                   static_cast<uint32_t>(kTagSize);
+    std::memset(key_block_, 0, sizeof(key_block_));
+    std::memcpy(key_block_, key, kKeySize);
+    std::memcpy(keyed_, initial_, sizeof(keyed_));
+    compress(keyed_, key_block_, kBlockSize, false);
+  }
+
+  size_t tag_size() const override { return kTagSize; }
+
+  void mac(const uint8_t* input, size_t size, uint8_t* tag) override {
+    uint32_t h[8];
+    if (size == 0) {
+      std::memcpy(h, initial_, sizeof(h));
+      compress(h, key_block_, kBlockSize, true);
+    } else {
+      std::memcpy(h, keyed_, sizeof(h));
+      uint64_t counter = kBlockSize;
+      for (; size > kBlockSize; input += kBlockSize, size -= kBlockSize) {
+        counter += kBlockSize;
+        compress(h, input, counter, false);
+      }
+      uint8_t block[kBlockSize] = {};
+      std::memcpy(block, input, size);
+      compress(h, block, counter + size, true);
+    }
+    std::memcpy(tag, h, kTagSize);
+  }
+
+ private:
+  constexpr static size_t kBlockSize = 64;
+  constexpr static uint32_t kIV[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372,
+                                      0xA54FF53A, 0x510E527F, 0x9B05688C,
+                                      0x1F83D9AB, 0x5BE0CD19};
+  constexpr static uint8_t kSigma[10][16] = {
+      {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+      {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+      {11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+      {7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+      {9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+      {2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+      {12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+      {13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+      {6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+      {10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0},
+  };
+
+  static void mix(uint32_t* v, size_t a, size_t b, size_t c, size_t d,
+                  uint32_t x, uint32_t y) {
+    v[a] = v[a] + v[b] + x;
+    v[d] = rotr32(v[d] ^ v[a], 16);
+    v[c] = v[c] + v[d];
+    v[b] = rotr32(v[b] ^ v[c], 12);
+    v[a] = v[a] + v[b] + y;
+    v[d] = rotr32(v[d] ^ v[a], 8);
+    v[c] = v[c] + v[d];
+    v[b] = rotr32(v[b] ^ v[c], 7);
+  }
+
+  // Folds the 64 byte |block| into |h|. |counter| is the bytes hashed so
+  // far including this block.
+  static void compress(uint32_t* h, const uint8_t* block, uint64_t counter,
+                       bool last) {
+    uint32_t m[16];
+    std::memcpy(m, block, sizeof(m));
+    uint32_t v[16];
+    std::memcpy(v, h, 8 * sizeof(uint32_t));
+    std::memcpy(v + 8, kIV, sizeof(kIV));
+    v[12] ^= static_cast<uint32_t>(counter);
+    v[13] ^= static_cast<uint32_t>(counter >> 32);
+    if (last) {
+      v[14] = ~v[14];
+    }
+    for (const auto& s : kSigma) {
+      mix(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+      mix(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+      mix(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+      mix(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+      mix(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+      mix(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+      mix(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+      mix(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+    for (size_t i = 0; i < 8; ++i) {
+      h[i] ^= v[i] ^ v[i + 8];
+    }
+  }
+
+  uint32_t initial_[8];
+  uint32_t keyed_[8];
+  uint8_t key_block_[kBlockSize];
+};
+
+}  // namespace opentoken
+
+#endif  // _OPENTOKEN__HARE__MAC_H_
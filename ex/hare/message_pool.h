@@ -0,0 +1,88 @@
+#ifndef _OPENTOKEN__HARE__MESSAGE_POOL_H_
+#define _OPENTOKEN__HARE__MESSAGE_POOL_H_
+
+#include "check.h"
+#include "network.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+namespace opentoken {
+
+// A fixed set of UDPMessages allocated once up front. Stages pass messages
+// along by Handle, a small index, instead of copying them, and whoever holds
+// a handle owns its message until releasing it. Handles may be passed to
+// other threads, but acquire and release must stay on one.
+class UDPMessagePool final {
+ public:
+  using Handle = uint32_t;
+
+  explicit UDPMessagePool(size_t capacity)
+      : capacity_(capacity),
+        messages_(new UDPMessage[capacity]),
+        acquired_(capacity, false) {
+    CHECK(capacity > 0 && capacity <= UINT32_MAX, "bad pool size %zu",
+          capacity);
+    free_.reserve(capacity);
+    for (size_t i = capacity; i > 0; --i) {
+      free_.push_back(static_cast<Handle>(i - 1));
+    }
+  }
+
+  // Fills |handles| with up to |count| free messages and returns how many
+  // it got, which is 0 when the pool is exhausted.
+  size_t acquire_many(Handle* handles, size_t count) {
+    count = std::min(count, free_.size());
+    if (count == 0) {
+      ++exhausted_;
+    }
+    for (size_t i = 0; i < count; ++i) {
+      handles[i] = free_.back();
+      free_.pop_back();
+      acquired_[handles[i]] = true;
+    }
+    peak_in_use_ = std::max(peak_in_use_, in_use());
+    return count;
+  }
+
+  void release_many(const Handle* handles, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      CHECK(handles[i] < capacity_ && acquired_[handles[i]],
+            "released message %u is not acquired", handles[i]);
+      acquired_[handles[i]] = false;
+      free_.push_back(handles[i]);
+    }
+  }
+
+  UDPMessage& get(Handle handle) { return messages_[handle]; }
+
+  size_t capacity() const { return capacity_; }
+  size_t in_use() const { return capacity_ - free_.size(); }
+
+  // Writes occupancy since the last report.
+  void report(FILE* f) {
+    fprintf(f, "message pool: %zu of %zu in use, peak %zu, exhausted %llu\n",
+            in_use(), capacity_, peak_in_use_,
+            static_cast<unsigned long long>(exhausted_));
+    peak_in_use_ = in_use();
+    exhausted_ = 0;
+  }
+
+ private:
+  UDPMessagePool(UDPMessagePool&) = delete;
+  UDPMessagePool(UDPMessagePool&&) = delete;
+
+  const size_t capacity_;
+  const std::unique_ptr<UDPMessage[]> messages_;
+  std::vector<Handle> free_;
+  std::vector<bool> acquired_;
+  size_t peak_in_use_ = 0;
+  uint64_t exhausted_ = 0;
+};
+
+}  // namespace opentoken
+
+#endif  // _OPENTOKEN__HARE__MESSAGE_POOL_H_
@@ -4,9 +4,18 @@
 #include "check.h"
 
 #include <arpa/inet.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
+#endif
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <algorithm>
+#include <cstdint>
 #include <cstring>
 #include <string>
 
@@ -21,6 +30,23 @@ string sockaddr_to_string(const sockaddr_in& addr) {
          std::to_string(ntohs(addr.sin_port));
 }
 
+// Packs an IPv4 address and port into one integer, e.g. for hashing.
+uint64_t sockaddr_key(const sockaddr_in& addr) {
+  return static_cast<uint64_t>(ntohl(addr.sin_addr.s_addr)) << 16 |
+         ntohs(addr.sin_port);
+}
+
+in_addr string_to_in_addr(const string& addr_str) {
+  in_addr result;
+  CHECK(inet_pton(AF_INET, addr_str.c_str(), &result) > 0, "bad address %s",
+        addr_str.c_str());
+  return result;
+}
+
+inline bool is_multicast(const sockaddr_in& addr) {
+  return IN_MULTICAST(ntohl(addr.sin_addr.s_addr));
+}
+
 sockaddr_in string_to_sockaddr(string addr_str) {
   const auto colon_pos = addr_str.find(':');
   CHECK(colon_pos != std::string::npos);
@@ -34,13 +60,91 @@ sockaddr_in string_to_sockaddr(string addr_str) {
   return result;
 }
 
+constexpr size_t kCacheLineSize = 64;
+
+// Room for the control messages requested on hare sockets.
+constexpr size_t kRecvControlSize = 256;
+
+// Asks the kernel to timestamp everything received on |fd| as it comes off
+// the network, so latency measurements exclude our own queueing and parsing.
+void enable_rx_timestamps(int fd) {
+#ifdef __linux__
+  const int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+  CHECK_ERRNO(setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+                         sizeof(flags)) == 0);
+#else
+  (void)fd;
+#endif
+}
+
+// Returns the kernel receive time in |header|'s control messages, in
+// nanoseconds since the epoch, or 0 if there is none.
+uint64_t rx_timestamp_nanos(msghdr* header) {
+#ifdef __linux__
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(header); cmsg;
+       cmsg = CMSG_NXTHDR(header, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_TIMESTAMPING) {
+      scm_timestamping timestamps;
+      std::memcpy(&timestamps, CMSG_DATA(cmsg), sizeof(timestamps));
+      const timespec& t = timestamps.ts[0];
+      return static_cast<uint64_t>(t.tv_sec * 1000000000LL + t.tv_nsec);
+    }
+  }
+#else
+  (void)header;
+#endif
+  return 0;
+}
+
+// Sets |*dropped| to the number of datagrams the socket dropped for lack of
+// buffer space, from |header|'s control messages. Returns false if there is
+// no count, because drop counting is off or nothing was dropped yet.
+bool rx_queue_drops(msghdr* header, uint32_t* dropped) {
+#ifdef SO_RXQ_OVFL
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(header); cmsg;
+       cmsg = CMSG_NXTHDR(header, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+      std::memcpy(dropped, CMSG_DATA(cmsg), sizeof(*dropped));
+      return true;
+    }
+  }
+#else
+  (void)header;
+  (void)dropped;
+#endif
+  return false;
+}
+
+// Kernel receive time of the oldest unread bytes on stream socket |fd|,
+// read with MSG_PEEK so the owner of the socket still gets the data.
+// Returns 0 if nothing is queued or timestamps are not enabled.
+inline uint64_t peek_rx_timestamp_nanos(int fd) {
+  uint8_t byte;
+  iovec iov{&byte, sizeof(byte)};
+  alignas(cmsghdr) uint8_t control[kRecvControlSize];
+  msghdr header{};
+  header.msg_iov = &iov;
+  header.msg_iovlen = 1;
+  header.msg_control = control;
+  header.msg_controllen = sizeof(control);
+  if (recvmsg(fd, &header, MSG_PEEK | MSG_DONTWAIT) <= 0) {
+    return 0;
+  }
+  return rx_timestamp_nanos(&header);
+}
+
 }  // namespace
 
+// Starts on a cache line, with the fields a batch walks through in the first
+// one, and is never copied: stages that share messages pass UDPMessagePool
+// handles.
 class UDPMessage final {
  public:
+  constexpr static size_t kBufferSize = 8192;
+
   UDPMessage() = default;
   explicit UDPMessage(size_t size) : size_(size) {}
-  UDPMessage(UDPMessage&) = default;
 
   size_t Recv(int socket) {
     socklen_t addrlen = sizeof(addr_);
@@ -64,6 +168,34 @@ class UDPMessage final {
     CHECK(bytes_sent == static_cast<ssize_t>(size_));
   }
 
+  // Points |header| at this message's buffer and address so that a batch of
+  // messages can be handed to recvmmsg/sendmmsg in one call.
+  void FillHeader(msghdr* header, iovec* iov) const {
+    iov->iov_base = const_cast<uint8_t*>(buf_);
+    iov->iov_len = size_;
+    *header = {};
+    header->msg_name = const_cast<sockaddr_in*>(&addr_);
+    header->msg_namelen = sizeof(addr_);
+    header->msg_iov = iov;
+    header->msg_iovlen = 1;
+  }
+
+  void FillRecvHeader(msghdr* header, iovec* iov, uint8_t* control) {
+    size_ = kBufferSize;
+    FillHeader(header, iov);
+    header->msg_control = control;
+    header->msg_controllen = kRecvControlSize;
+  }
+
+  void FinishRecv(msghdr* header, size_t recvlen) {
+    CHECK(header->msg_namelen == sizeof(addr_));
+    CHECK(!(header->msg_flags & MSG_TRUNC), "truncated %zu byte message",
+          recvlen);
+    CHECK(recvlen < kBufferSize);
+    size_ = recvlen;
+    rx_nanos_ = rx_timestamp_nanos(header);
+  }
+
   void SetSize(size_t size) {
     CHECK(size <= kBufferSize);
     size_ = size;
@@ -72,39 +204,83 @@ class UDPMessage final {
   void SetAddrFromString(const string& addr_str) {
     addr_ = string_to_sockaddr(addr_str);
   };
+  void SetAddr(const sockaddr_in& addr) { addr_ = addr; };
   void CopyAddrFrom(const UDPMessage& other) { addr_ = other.addr(); };
 
   size_t max_size() const { return kBufferSize; };
+  // When the kernel received this datagram, in nanoseconds since the epoch.
+  // 0 if the socket does not have timestamps enabled.
+  uint64_t rx_nanos() const { return rx_nanos_; }
   size_t size() const { return size_; };
   const uint8_t* data() const { return buf_; };
   uint8_t* data() { return buf_; };
 
   sockaddr_in addr() const { return addr_; };
+  uint64_t addr_key() const { return sockaddr_key(addr_); }
   string addr_str() const { return sockaddr_to_string(addr_); };
   string data_str() const { return string{(char*)&buf_[0], size_}; }
 
  private:
-  constexpr static size_t kBufferSize = 8192;
+  UDPMessage(UDPMessage&) = delete;
+  UDPMessage(UDPMessage&&) = delete;
 
-  uint8_t buf_[kBufferSize] __attribute__((__aligned__(8))) = {};
-  size_t size_ = 0;
+  alignas(kCacheLineSize) size_t size_ = 0;
+  uint64_t rx_nanos_ = 0;
   sockaddr_in addr_;
+  alignas(kCacheLineSize) uint8_t buf_[kBufferSize] = {};
+};
+
+// A datagram in someone else's buffer, e.g. a PacketRing slot or one of the
+// datagrams coalesced by GRO. Has the read side of the UDPMessage interface
+// but is only valid until the callback it was passed to returns.
+class UDPPacketView final {
+ public:
+  UDPPacketView(const uint8_t* data, size_t size, const sockaddr_in& addr,
+                uint64_t rx_nanos)
+      : data_(data), size_(size), addr_(addr), rx_nanos_(rx_nanos) {}
+
+  uint64_t rx_nanos() const { return rx_nanos_; }
+  size_t size() const { return size_; }
+  const uint8_t* data() const { return data_; }
+
+  sockaddr_in addr() const { return addr_; }
+  uint64_t addr_key() const { return sockaddr_key(addr_); }
+  std::string addr_str() const { return sockaddr_to_string(addr_); }
+
+ private:
+  const uint8_t* const data_;
+  const size_t size_;
+  const sockaddr_in addr_;
+  const uint64_t rx_nanos_;
 };
 
 class UDPSocket final {
  public:
-  UDPSocket(int port) : fd_(socket(AF_INET, SOCK_DGRAM, 0)) {
+  // With |reuse_port|, several sockets (typically one per thread) can bind
+  // the same port and the kernel spreads datagrams across them.
+  explicit UDPSocket(int port, bool reuse_port = false)
+      : fd_(socket(AF_INET, SOCK_DGRAM, 0)) {
     CHECK(fd_ > 0);
 
+    if (reuse_port) {
+      const int one = 1;
+      CHECK_ERRNO(setsockopt(fd_, SOL_SOCKET, SO_REUSEPORT, &one,
+                             sizeof(one)) == 0);
+    }
+
     my_addr_.sin_family = AF_INET;
     my_addr_.sin_addr.s_addr = htonl(INADDR_ANY);
     my_addr_.sin_port = htons(port);
 
     CHECK(bind(fd_, (sockaddr*)&my_addr_, sizeof(my_addr_)) >= 0,
           "port %d probably in use", port);
+    enable_rx_timestamps(fd_);
   }
 
-  UDPSocket() : fd_(socket(AF_INET, SOCK_DGRAM, 0)) { CHECK(fd_ > 0); }
+  UDPSocket() : fd_(socket(AF_INET, SOCK_DGRAM, 0)) {
+    CHECK(fd_ > 0);
+    enable_rx_timestamps(fd_);
+  }
 
   ~UDPSocket() { close(fd_); }
 
@@ -117,13 +293,402 @@ class UDPSocket final {
 
   void send_one(const UDPMessage& message) { message.Send(fd_); }
 
+  // Receives up to |count| already queued datagrams with one recvmmsg call.
+  // Never blocks. Returns the number of messages filled, which is 0 when the
+  // socket is drained.
+  size_t receive_many(UDPMessage* messages, size_t count) {
+    CHECK(messages);
+    CHECK(count <= kMaxBatchSize, "batch of %zu is too large", count);
+    UDPMessage* pointers[kMaxBatchSize];
+    for (size_t i = 0; i < count; ++i) {
+      pointers[i] = &messages[i];
+    }
+    return receive_many(pointers, count);
+  }
+
+  // The same for messages that are not stored contiguously, e.g. ones taken
+  // from a UDPMessagePool.
+  size_t receive_many(UDPMessage* const* messages, size_t count) {
+    CHECK(messages);
+    CHECK(count <= kMaxBatchSize, "batch of %zu is too large", count);
+#ifdef __linux__
+    mmsghdr headers[kMaxBatchSize];
+    iovec iovs[kMaxBatchSize];
+    alignas(cmsghdr) uint8_t controls[kMaxBatchSize][kRecvControlSize];
+    for (size_t i = 0; i < count; ++i) {
+      messages[i]->FillRecvHeader(&headers[i].msg_hdr, &iovs[i], controls[i]);
+    }
+
+    int received;
+    do {
+      received = recvmmsg(fd_, headers, static_cast<unsigned>(count),
+                          MSG_DONTWAIT, nullptr);
+    } while (received < 0 && errno == EINTR);
+    if (received < 0) {
+      CHECK_ERRNO(errno == EAGAIN || errno == EWOULDBLOCK);
+      return 0;
+    }
+
+    const auto num_received = static_cast<size_t>(received);
+    for (size_t i = 0; i < num_received; ++i) {
+      messages[i]->FinishRecv(&headers[i].msg_hdr, headers[i].msg_len);
+      dprintf("\nReceived %zu byte message from %s: \"%s\"\n",
+              messages[i]->size(), messages[i]->addr_str().c_str(),
+              messages[i]->data_str().c_str());
+    }
+    if (num_received > 0) {
+      count_drops(&headers[num_received - 1].msg_hdr);
+    }
+    return num_received;
+#else
+    for (size_t i = 0; i < count; ++i) {
+      msghdr header;
+      iovec iov;
+      alignas(cmsghdr) uint8_t control[kRecvControlSize];
+      messages[i]->FillRecvHeader(&header, &iov, control);
+      const auto recvlen = recvmsg(fd_, &header, MSG_DONTWAIT);
+      if (recvlen < 0) {
+        CHECK_ERRNO(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+        return i;
+      }
+      messages[i]->FinishRecv(&header, static_cast<size_t>(recvlen));
+      count_drops(&header);
+    }
+    return count;
+#endif
+  }
+
+  // Sends all |count| messages, using as few sendmmsg calls as the kernel
+  // allows.
+  void send_many(const UDPMessage* messages, size_t count) {
+    CHECK(messages);
+#ifdef __linux__
+    mmsghdr headers[kMaxBatchSize];
+    iovec iovs[kMaxBatchSize];
+    while (count > 0) {
+      const auto batch_size = std::min(count, kMaxBatchSize);
+      for (size_t i = 0; i < batch_size; ++i) {
+        CHECK(messages[i].size() > 0);
+        messages[i].FillHeader(&headers[i].msg_hdr, &iovs[i]);
+      }
+
+      const int sent =
+          sendmmsg(fd_, headers, static_cast<unsigned>(batch_size), 0);
+      if (sent < 0) {
+        CHECK_ERRNO(errno == EINTR);
+        continue;
+      }
+      const auto num_sent = static_cast<size_t>(sent);
+      for (size_t i = 0; i < num_sent; ++i) {
+        CHECK(headers[i].msg_len == messages[i].size());
+      }
+      messages += num_sent;
+      count -= num_sent;
+    }
+#else
+    for (size_t i = 0; i < count; ++i) {
+      messages[i].Send(fd_);
+    }
+#endif
+  }
+
+  // Lets send_batch() hand the kernel each run of equally sized datagrams as
+  // one buffer to split up (UDP GSO), which takes them through the stack
+  // once. Returns false if the kernel lacks it.
+  bool enable_gso() {
+#if defined(__linux__) && defined(UDP_SEGMENT)
+    const int zero = 0;
+    gso_ = setsockopt(fd_, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) == 0;
+#endif
+    return gso_;
+  }
+
+  // Sends the |count| datagrams in |datagrams| to |to|. With GSO, runs of
+  // datagrams of one size, the last of which may be shorter, go in one
+  // sendmsg call each, otherwise they go through sendmmsg. Falls back for
+  // good if the device cannot segment.
+  void send_batch(const iovec* datagrams, size_t count, const sockaddr_in& to) {
+    CHECK(datagrams);
+#if defined(__linux__) && defined(UDP_SEGMENT)
+    while (gso_ && count > 0) {
+      // An empty datagram cannot be a segment, so it goes alone and ends any
+      // run before it.
+      const size_t segment_size = datagrams[0].iov_len;
+      const size_t max_segments =
+          segment_size == 0
+              ? 1
+              : std::min(kMaxGsoSegments, kMaxGsoSize / segment_size);
+      size_t run = 1;
+      while (run < std::min(count, max_segments) &&
+             datagrams[run].iov_len > 0 &&
+             datagrams[run].iov_len <= segment_size) {
+        ++run;
+        if (datagrams[run - 1].iov_len < segment_size) {
+          break;
+        }
+      }
+
+      msghdr header{};
+      header.msg_name = const_cast<sockaddr_in*>(&to);
+      header.msg_namelen = sizeof(to);
+      header.msg_iov = const_cast<iovec*>(datagrams);
+      header.msg_iovlen = run;
+      alignas(cmsghdr) uint8_t control[CMSG_SPACE(sizeof(uint16_t))] = {};
+      if (run > 1) {
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        const auto size = static_cast<uint16_t>(segment_size);
+        std::memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+      }
+
+      if (sendmsg(fd_, &header, 0) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        // EIO when the device has no checksum offload to segment with.
+        CHECK_ERRNO(errno == EIO || errno == EINVAL);
+        fprintf(stderr, "UDP GSO failed, falling back to sendmmsg\n");
+        gso_ = false;
+        break;
+      }
+      datagrams += run;
+      count -= run;
+    }
+    mmsghdr headers[kMaxBatchSize];
+    while (count > 0) {
+      const auto batch_size = std::min(count, kMaxBatchSize);
+      for (size_t i = 0; i < batch_size; ++i) {
+        headers[i] = {};
+        headers[i].msg_hdr.msg_name = const_cast<sockaddr_in*>(&to);
+        headers[i].msg_hdr.msg_namelen = sizeof(to);
+        headers[i].msg_hdr.msg_iov = const_cast<iovec*>(&datagrams[i]);
+        headers[i].msg_hdr.msg_iovlen = 1;
+      }
+      const int sent =
+          sendmmsg(fd_, headers, static_cast<unsigned>(batch_size), 0);
+      if (sent < 0) {
+        CHECK_ERRNO(errno == EINTR);
+        continue;
+      }
+      datagrams += sent;
+      count -= static_cast<size_t>(sent);
+    }
+#else
+    for (size_t i = 0; i < count; ++i) {
+      CHECK(sendto(fd_, datagrams[i].iov_base, datagrams[i].iov_len, 0,
+                   reinterpret_cast<const sockaddr*>(&to),
+                   sizeof(to)) == static_cast<ssize_t>(datagrams[i].iov_len));
+    }
+#endif
+  }
+
+  // Lets the kernel coalesce datagrams of one flow that arrive together
+  // into a single receive (UDP GRO), for receive_coalesced(). Returns false
+  // if the kernel lacks it.
+  bool enable_gro() {
+#if defined(__linux__) && defined(UDP_GRO)
+    const int one = 1;
+    return setsockopt(fd_, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+#else
+    return false;
+#endif
+  }
+
+  // Receives one batch of datagrams, coalesced by GRO if it is on, into
+  // |buffer|, which should have room for 64 KB, and passes each
+  // to on_message(const UDPPacketView&). Never blocks. Returns the number of
+  // datagrams, which is 0 when the socket is drained.
+  template <typename F>
+  size_t receive_coalesced(uint8_t* buffer, size_t size, const F& on_message) {
+    sockaddr_in addr;
+    iovec iov{buffer, size};
+    alignas(cmsghdr) uint8_t control[kRecvControlSize];
+    msghdr header{};
+    header.msg_name = &addr;
+    header.msg_namelen = sizeof(addr);
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+
+    ssize_t received;
+    do {
+      received = recvmsg(fd_, &header, MSG_DONTWAIT);
+    } while (received < 0 && errno == EINTR);
+    if (received < 0) {
+      CHECK_ERRNO(errno == EAGAIN || errno == EWOULDBLOCK);
+      return 0;
+    }
+    CHECK(!(header.msg_flags & MSG_TRUNC), "truncated %zd byte receive",
+          received);
+
+    auto remaining = static_cast<size_t>(received);
+    size_t segment_size = remaining;
+#if defined(__linux__) && defined(UDP_GRO)
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&header); cmsg;
+         cmsg = CMSG_NXTHDR(&header, cmsg)) {
+      if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+        int gso_size;
+        std::memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+        segment_size = static_cast<size_t>(gso_size);
+      }
+    }
+#endif
+    count_drops(&header);
+    const uint64_t rx_nanos = rx_timestamp_nanos(&header);
+    size_t num_received = 0;
+    for (const uint8_t* data = buffer; remaining > 0; ++num_received) {
+      const size_t datagram_size = std::min(segment_size, remaining);
+      on_message(UDPPacketView{data, datagram_size, addr, rx_nanos});
+      data += datagram_size;
+      remaining -= datagram_size;
+    }
+    return num_received;
+  }
+
   int fd() const { return fd_; }
 
+  // Asks for |bytes| of kernel receive buffer, past net.core.rmem_max if we
+  // have CAP_NET_ADMIN. Returns the size granted.
+  size_t set_receive_buffer(size_t bytes) {
+#ifdef SO_RCVBUFFORCE
+    set_buffer_size(SO_RCVBUFFORCE, SO_RCVBUF, bytes);
+#else
+    set_buffer_size(SO_RCVBUF, SO_RCVBUF, bytes);
+#endif
+    return receive_buffer();
+  }
+
+  // The same for the send buffer and net.core.wmem_max.
+  size_t set_send_buffer(size_t bytes) {
+#ifdef SO_SNDBUFFORCE
+    set_buffer_size(SO_SNDBUFFORCE, SO_SNDBUF, bytes);
+#else
+    set_buffer_size(SO_SNDBUF, SO_SNDBUF, bytes);
+#endif
+    return buffer_size(SO_SNDBUF);
+  }
+
+  size_t receive_buffer() const { return buffer_size(SO_RCVBUF); }
+
+  // Has receives note how many datagrams the kernel dropped because the
+  // receive buffer was full, see kernel_drops().
+  void enable_drop_counter() {
+#ifdef SO_RXQ_OVFL
+    const int one = 1;
+    CHECK_ERRNO(setsockopt(fd_, SOL_SOCKET, SO_RXQ_OVFL, &one,
+                           sizeof(one)) == 0);
+#endif
+  }
+
+  // Datagrams the kernel dropped for lack of buffer space, as of the last
+  // receive_many() or receive_coalesced().
+  uint64_t kernel_drops() const { return kernel_drops_; }
+
+  // Hops a multicast datagram may take; 1 keeps it on the local segment.
+  void set_multicast_ttl(int ttl) {
+    CHECK(ttl >= 0 && ttl <= 255, "bad multicast ttl %d", ttl);
+    const unsigned char value = static_cast<unsigned char>(ttl);
+    CHECK_ERRNO(setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_TTL, &value,
+                           sizeof(value)) == 0);
+  }
+
+  // Whether receivers on this host get our multicast datagrams too.
+  void set_multicast_loop(bool loop) {
+    const unsigned char value = loop;
+    CHECK_ERRNO(setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_LOOP, &value,
+                           sizeof(value)) == 0);
+  }
+
+  // Sends multicast out of the interface with local address |iface_addr_str|
+  // rather than the one the routing table picks.
+  void set_multicast_interface(const string& iface_addr_str) {
+    const in_addr iface = string_to_in_addr(iface_addr_str);
+    CHECK_ERRNO(setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_IF, &iface,
+                           sizeof(iface)) == 0);
+  }
+
+  // Receives datagrams sent to multicast |group_str| on our port, on the
+  // interface with local address |iface_addr_str| (any by default).
+  void join_multicast_group(const string& group_str,
+                            const string& iface_addr_str = "0.0.0.0") {
+    ip_mreq request{};
+    request.imr_multiaddr = string_to_in_addr(group_str);
+    request.imr_interface = string_to_in_addr(iface_addr_str);
+    CHECK(IN_MULTICAST(ntohl(request.imr_multiaddr.s_addr)),
+          "%s is not a multicast group", group_str.c_str());
+    CHECK_ERRNO(setsockopt(fd_, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request,
+                           sizeof(request)) == 0);
+  }
+
+#ifdef __linux__
+  // Runs |program| on every datagram before it is queued; datagrams it
+  // returns 0 for are dropped. The program sees the UDP header at offset 0.
+  void attach_filter(sock_filter* program, size_t length) {
+    sock_fprog fprog{static_cast<unsigned short>(length), program};
+    CHECK_ERRNO(setsockopt(fd_, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+                           sizeof(fprog)) == 0);
+  }
+
+  // Replaces the kernel's 4-tuple hash for this socket's SO_REUSEPORT group
+  // with |program|, which returns the index (in bind order) of the socket
+  // that gets each datagram. The program sees the UDP payload at offset 0.
+  void attach_reuseport_program(sock_filter* program, size_t length) {
+    sock_fprog fprog{static_cast<unsigned short>(length), program};
+    CHECK_ERRNO(setsockopt(fd_, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &fprog,
+                           sizeof(fprog)) == 0);
+  }
+#endif
+
+  // Upper bound on the |count| accepted by receive_many.
+  constexpr static size_t kMaxBatchSize = 64;
+  // Limits of one GSO send, and so of one GRO receive.
+  constexpr static size_t kMaxGsoSegments = 64;
+  constexpr static size_t kMaxGsoSize = 65507;
+
  private:
   UDPSocket(const UDPSocket&) = delete;
 
+  // Sets buffer |option|, falling back to the capped |fallback_option|
+  // without the privilege to force it.
+  void set_buffer_size(int option, int fallback_option, size_t bytes) {
+    CHECK(bytes <= INT32_MAX / 2, "%zu byte socket buffer", bytes);
+    const int value = static_cast<int>(bytes);
+    if (setsockopt(fd_, SOL_SOCKET, option, &value, sizeof(value)) != 0) {
+      CHECK_ERRNO(setsockopt(fd_, SOL_SOCKET, fallback_option, &value,
+                             sizeof(value)) == 0);
+    }
+  }
+
+  size_t buffer_size(int option) const {
+    int value;
+    socklen_t length = sizeof(value);
+    CHECK_ERRNO(getsockopt(fd_, SOL_SOCKET, option, &value, &length) == 0);
+#ifdef __linux__
+    // Linux doubles what was asked for to account for its bookkeeping.
+    value /= 2;
+#endif
+    return static_cast<size_t>(value);
+  }
+
+  // The kernel's count wraps at 32 bits.
+  void count_drops(msghdr* header) {
+    uint32_t dropped;
+    if (rx_queue_drops(header, &dropped)) {
+      kernel_drops_ += static_cast<uint32_t>(dropped - last_dropped_);
+      last_dropped_ = dropped;
+    }
+  }
+
   const int fd_;
   sockaddr_in my_addr_;
+  bool gso_ = false;
+  uint32_t last_dropped_ = 0;
+  uint64_t kernel_drops_ = 0;
 };
 
 }  // namespace opentoken
@@ -0,0 +1,1130 @@
+#ifndef _OPENTOKEN__HARE__PROTOCOL_H_
+#define _OPENTOKEN__HARE__PROTOCOL_H_
+
+#include "binance.h"
+#include "check.h"
+#include "clock_sync.h"
+#include "fec.h"
+#include "hasher.h"
+#include "network.h"
+#include "packet_ring.h"
+#include "sequence.h"
+#include "timing.h"
+#include "trade_encoding.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace opentoken {
+
+constexpr uint16_t kPacketMagic = 0x4148;  // "HA" on the wire
+constexpr uint8_t kProtocolVersion = 3;
+
+// Largest UDP payload that fits in a single 1500 byte ethernet frame.
+constexpr size_t kDefaultMaxPacketSize = 1472;
+
+enum class PacketType : uint8_t {
+  Unknown = 0,
+  Trades,         // sender -> receiver, BinanceTrade records
+  Nack,           // receiver -> sender, SequenceRange records
+  Hello,          // receiver -> sender, one HelloRecord
+  CompactTrades,  // sender -> receiver, see CompactTradeCodec
+  TimeRequest,    // receiver -> sender, one ClockSample
+  TimeReply,      // sender -> receiver, the ClockSample filled in
+  Parity,         // sender -> receiver, see ParityEncoder
+  Heartbeat,      // sender -> receiver, one HeartbeatRecord
+  Messages,       // sender -> receiver, see MessageHeader
+};
+
+// What a Messages record holds. Trades keep their own packet types, which
+// have encodings to agree on. Only append.
+enum class MessageType : uint8_t {
+  Unknown = 0,
+  DepthUpdate,  // BinanceDepthUpdate up to its last level
+  BookTicker,   // BinanceBookTicker
+  Ticker,       // BinanceTicker
+};
+
+// Each record of a Messages packet is a MessageHeader followed by |size|
+// bytes of the message, a multiple of 8 so the next header stays aligned.
+// Later versions of a type only append fields, so readers decode the ones
+// they know from any version and skip types they do not know.
+struct MessageHeader {
+  MessageType type;
+  uint8_t version;
+  uint16_t reserved;
+  uint32_t size;
+};
+
+constexpr uint8_t kDepthUpdateVersion = 1;
+constexpr uint8_t kBookTickerVersion = 1;
+constexpr uint8_t kTickerVersion = 1;
+
+// Bytes of |update| that go on the wire.
+constexpr size_t message_size(const BinanceDepthUpdate& update) {
+  return offsetof(BinanceDepthUpdate, levels) +
+         (update.num_bids + update.num_asks) * sizeof(PriceLevel);
+}
+
+constexpr size_t message_size(const BinanceBookTicker&) {
+  return sizeof(BinanceBookTicker);
+}
+
+constexpr size_t message_size(const BinanceTicker&) {
+  return sizeof(BinanceTicker);
+}
+
+static_assert(offsetof(BinanceDepthUpdate, levels) % 8 == 0 &&
+                  sizeof(PriceLevel) % 8 == 0 &&
+                  sizeof(BinanceBookTicker) % 8 == 0 &&
+                  sizeof(BinanceTicker) % 8 == 0,
+              "messages must keep the next header aligned");
+
+// What a receiver understands, sent to each sender it hears from.
+struct HelloRecord {
+  TradeEncoding max_trade_encoding;
+  uint8_t reserved;
+  // How many entries of kSymbols the receiver knows, and their
+  // symbols_digest().
+  uint16_t num_symbols;
+  uint32_t symbols_digest;
+};
+
+// Sent while a sender has no trades to send, so receivers can tell that it
+// is up and whether they missed the end of the last burst.
+struct HeartbeatRecord {
+  // The last sequenced packet sent, 0 for none yet.
+  uint64_t last_sequence;
+};
+
+// Senders check every this many milliseconds (HARE_HEARTBEAT_MS) whether
+// they sent anything since the last check and send a Heartbeat if not, so a
+// live sender is heard from at least every two intervals.
+constexpr uint64_t kDefaultHeartbeatMs = 5;
+// Receivers report a sender silent after three heartbeat intervals without
+// a packet: the two a live sender may take, plus one for jitter.
+constexpr uint64_t kDefaultSenderTimeoutNanos =
+    3 * 1000000ULL * kDefaultHeartbeatMs;
+
+// Every hare datagram is a PacketHeader, |count| records and an HMAC over
+// everything before it. Records have a fixed size except in CompactTrades,
+// Parity and Messages.
+struct PacketHeader {
+  uint16_t magic;
+  uint8_t version;
+  PacketType type;
+  uint16_t count;
+  // Which of the sender's per-market streams this is, see market_shard().
+  // Receivers running one thread per shard steer on it.
+  uint8_t shard;
+  uint8_t reserved;
+  // Chosen by the sender at startup so receivers can tell a restart from
+  // a sequence gap. A Nack echoes the session it refers to.
+  uint64_t session;
+  // Per-session sequence of trade and Messages packets, starting at 1. In
+  // Parity, the first of the |count| packets covered. Unused in Nacks.
+  uint64_t sequence;
+  // When the sender's kernel received the first of the records over WSS,
+  // and when the sender started signing the datagram, by the sender's
+  // clock in nanoseconds since the epoch. Only set in trade and Messages
+  // packets.
+  uint64_t wss_rx_nanos;
+  uint64_t send_nanos;
+};
+
+static_assert(sizeof(PacketHeader) % alignof(BinanceTrade) == 0,
+              "trades following the header must stay aligned");
+
+constexpr size_t record_size(PacketType type) {
+  switch (type) {
+    case PacketType::Trades:
+      return sizeof(BinanceTrade);
+    case PacketType::Nack:
+      return sizeof(SequenceRange);
+    case PacketType::Hello:
+      return sizeof(HelloRecord);
+    case PacketType::TimeRequest:
+    case PacketType::TimeReply:
+      return sizeof(ClockSample);
+    case PacketType::Heartbeat:
+      return sizeof(HeartbeatRecord);
+    default:
+      return 0;
+  }
+}
+
+constexpr size_t packet_size(PacketType type, size_t count) {
+  return sizeof(PacketHeader) + count * record_size(type) + kHashSizeBytes;
+}
+
+// How much larger a Parity datagram is than the largest one it covers.
+constexpr size_t kParityOverhead =
+    sizeof(PacketHeader) + sizeof(ParityRecord) + kHashSizeBytes;
+
+// Bytes left for records in a datagram of |max_packet_size|.
+constexpr size_t max_payload_size(size_t max_packet_size) {
+  return max_packet_size - sizeof(PacketHeader) - kHashSizeBytes;
+}
+
+constexpr size_t max_records_per_packet(PacketType type,
+                                        size_t max_packet_size) {
+  return max_payload_size(max_packet_size) / record_size(type);
+}
+
+// Stable assignment of markets to |num_shards| streams, shared by senders
+// and receivers so that each market always travels the same path.
+inline size_t market_shard(const char* market, size_t num_shards) {
+  uint32_t hash = 2166136261u;  // FNV-1a
+  for (const char* c = market; *c; ++c) {
+    hash = (hash ^ static_cast<uint8_t>(*c)) * 16777619u;
+  }
+  return hash % num_shards;
+}
+
+#ifdef __linux__
+// Steers each datagram arriving on the SO_REUSEPORT group of |socket| to the
+// socket whose bind order matches PacketHeader::shard. Datagrams from
+// senders with more shards than the group wrap around.
+inline void attach_shard_steering(UDPSocket* socket, size_t num_shards) {
+  sock_filter program[] = {
+      BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offsetof(PacketHeader, shard)),
+      BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>(num_shards)),
+      BPF_STMT(BPF_RET | BPF_A, 0),
+  };
+  socket->attach_reuseport_program(program,
+                                   sizeof(program) / sizeof(program[0]));
+}
+
+// Multicast hands a copy of each datagram to every socket that joined the
+// group instead of picking one, so each shard's socket has to drop the
+// datagrams of the others.
+inline void attach_shard_filter(UDPSocket* socket, size_t shard,
+                                size_t num_shards) {
+  sock_filter program[] = {
+      BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+               sizeof(udphdr) + offsetof(PacketHeader, shard)),
+      BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>(num_shards)),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(shard), 0, 1),
+      BPF_STMT(BPF_RET | BPF_K, ~0u),
+      BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  socket->attach_filter(program, sizeof(program) / sizeof(program[0]));
+}
+
+// The same steering for the PacketRings in fanout |group|, which must join
+// it in shard order.
+inline void attach_shard_steering(PacketRing* ring, uint16_t group,
+                                  size_t num_shards) {
+  sock_filter program[] = {
+      BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+      BPF_STMT(BPF_LD | BPF_B | BPF_IND,
+               sizeof(udphdr) + offsetof(PacketHeader, shard)),
+      BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>(num_shards)),
+      BPF_STMT(BPF_RET | BPF_A, 0),
+  };
+  ring->join_fanout(group, program, sizeof(program) / sizeof(program[0]));
+}
+#endif
+
+// Fills in the header of |message|, which already holds |count| records of
+// |type| in |payload_size| bytes, and sizes it to leave room for the
+// signature after them.
+inline void frame_packet(PacketType type, size_t count, size_t payload_size,
+                         uint8_t shard, uint64_t session, uint64_t sequence,
+                         UDPMessage* message, uint64_t wss_rx_nanos = 0) {
+  auto* header = reinterpret_cast<PacketHeader*>(message->data());
+  *header = PacketHeader{
+      kPacketMagic,
+      kProtocolVersion,
+      type,
+      static_cast<uint16_t>(count),
+      shard,
+      0,
+      session,
+      sequence,
+      wss_rx_nanos,
+      wss_rx_nanos ? nanos_since_epoch() : 0,
+  };
+  message->SetSize(sizeof(PacketHeader) + payload_size + kHashSizeBytes);
+}
+
+// frame_packet(), then signs it.
+inline void seal_packet(Hasher* hasher, PacketType type, size_t count,
+                        size_t payload_size, uint8_t shard, uint64_t session,
+                        uint64_t sequence, UDPMessage* message,
+                        uint64_t wss_rx_nanos = 0) {
+  frame_packet(type, count, payload_size, shard, session, sequence, message,
+               wss_rx_nanos);
+  const size_t signed_size = sizeof(PacketHeader) + payload_size;
+  hasher->hash(message->data(), signed_size, message->data() + signed_size);
+}
+
+// Checks the framing of a hare datagram, held in a UDPMessage or a
+// PacketRing view, but not its signature. Returns its header, or nullptr
+// (after logging why) if the datagram is malformed.
+template <typename Message>
+const PacketHeader* check_packet_framing(const Message& message) {
+  if (message.size() < packet_size(PacketType::Unknown, 0)) {
+    fprintf(stderr, "short packet: %zu bytes\n", message.size());
+    return nullptr;
+  }
+  const auto* header = reinterpret_cast<const PacketHeader*>(message.data());
+  if (header->magic != kPacketMagic || header->version != kProtocolVersion) {
+    fprintf(stderr, "bad magic %04x or unsupported version %d\n",
+            header->magic, header->version);
+    return nullptr;
+  }
+  bool sized;
+  if (header->type == PacketType::CompactTrades ||
+      header->type == PacketType::Messages) {
+    sized = header->count > 0;
+  } else if (header->type == PacketType::Parity) {
+    sized = header->count > 0 &&
+            message.size() >= packet_size(header->type, 0) +
+                                  sizeof(ParityRecord) +
+                                  sizeof(PacketHeader);
+  } else {
+    sized = record_size(header->type) != 0 &&
+            message.size() == packet_size(header->type, header->count);
+  }
+  if (!sized) {
+    fprintf(stderr, "%zu bytes for %d records of type %d\n", message.size(),
+            header->count, static_cast<int>(header->type));
+    return nullptr;
+  }
+  return header;
+}
+
+// Checks the framing and signature of a hare datagram. Returns its header,
+// or nullptr (after logging why) if the datagram is not valid.
+template <typename Message>
+const PacketHeader* verify_packet(const Message& message, Hasher* hasher) {
+  const auto* header = check_packet_framing(message);
+  if (!header) {
+    return nullptr;
+  }
+  const size_t signed_size = message.size() - kHashSizeBytes;
+  if (!hasher->is_valid_signature(message.data(), signed_size,
+                                  message.data() + signed_size)) {
+    fprintf(stderr, "bad signature on packet from %s\n",
+            message.addr_str().c_str());
+    return nullptr;
+  }
+  return header;
+}
+
+template <typename T, typename Message>
+const T* packet_records(const Message& message) {
+  return reinterpret_cast<const T*>(message.data() + sizeof(PacketHeader));
+}
+
+// Sends |to| a datagram of one |record| about |session|, for the receiver
+// thread of |shard|.
+template <typename T>
+void send_record(UDPSocket* socket, Hasher* hasher, const sockaddr_in& to,
+                 PacketType type, uint64_t session, const T& record,
+                 uint8_t shard = 0) {
+  CHECK(sizeof(T) == record_size(type));
+  UDPMessage message;
+  message.SetAddr(to);
+  std::memcpy(message.data() + sizeof(PacketHeader), &record, sizeof(record));
+  seal_packet(hasher, type, 1, sizeof(record), shard, session, 0, &message);
+  socket->send_one(message);
+}
+
+// Asks the sender of |session| to resend the packets in |missing|.
+inline void send_nack(UDPSocket* socket, Hasher* hasher,
+                      const sockaddr_in& to, uint64_t session,
+                      const SequenceRange& missing) {
+  send_record(socket, hasher, to, PacketType::Nack, session, missing);
+}
+
+// Tells the sender of |session| which trade encodings and market ids we
+// understand.
+inline void send_hello(UDPSocket* socket, Hasher* hasher,
+                       const sockaddr_in& to, uint64_t session,
+                       TradeEncoding max_trade_encoding) {
+  send_record(socket, hasher, to, PacketType::Hello, session,
+              HelloRecord{max_trade_encoding, 0,
+                          static_cast<uint16_t>(kNumSymbols),
+                          symbols_digest(kNumSymbols)});
+}
+
+// Starts a round trip to measure the clock offset of the sender of
+// |session|.
+inline void send_time_request(UDPSocket* socket, Hasher* hasher,
+                              const sockaddr_in& to, uint64_t session) {
+  send_record(socket, hasher, to, PacketType::TimeRequest, session,
+              ClockSample{nanos_since_epoch(), 0, 0});
+}
+
+// Packs trades, depth updates and tickers into signed, sequenced
+// datagrams. A datagram holds trades or Messages records, and is sent when
+// it is full, when the next record is of the other kind, when flush() is
+// called (the sender does so at the end of each WSS read batch) or when a
+// record is added more than |flush_deadline_nanos| after the first unsent
+// one. The deadline is only checked as records are added: it keeps a long
+// batch from holding datagrams back, and the flush() at the end of the
+// batch bounds the wait for the last one. The last |retransmit_capacity|
+// datagrams are kept for resending on a Nack.
+//
+// With a parity group size of K, every K datagrams are followed by a Parity
+// datagram from which receivers rebuild any one of them without waiting a
+// round trip for the retransmit.
+//
+// With batched sends, full datagrams are held back until flush() and then
+// signed with one Hasher::hash_batch() and sent together, with UDP GSO when
+// the socket has it on. Compact full datagrams are padded to the maximum
+// size so that a burst is one run of equally sized datagrams.
+//
+// Trades go out raw until a receiver says Hello, then in the newest encoding
+// up to |max_trade_encoding| that every receiver heard from understands,
+// with the market ids they all know. A receiver whose ids differ from ours
+// keeps them raw.
+class TradePacketWriter final {
+ public:
+  TradePacketWriter(Hasher* hasher, UDPSocket* socket,
+                    const std::string& destination_address_str,
+                    size_t max_packet_size, uint64_t flush_deadline_nanos,
+                    size_t retransmit_capacity, uint8_t shard = 0,
+                    TradeEncoding max_trade_encoding = kNewestTradeEncoding)
+      : hasher_(CHECK_NOTNULL(hasher)),
+        socket_(CHECK_NOTNULL(socket)),
+        shard_(shard),
+        max_trades_(
+            max_records_per_packet(PacketType::Trades, max_packet_size)),
+        max_payload_size_(max_payload_size(max_packet_size)),
+        max_trade_encoding_(max_trade_encoding),
+        flush_deadline_nanos_(flush_deadline_nanos),
+        session_(nanos_since_epoch()),
+        retransmit_ring_(retransmit_capacity, max_packet_size),
+        parity_(max_packet_size) {
+    CHECK(max_packet_size <= message_.max_size(),
+          "max packet size %zu exceeds buffer", max_packet_size);
+    CHECK(max_trades_ > 0, "max packet size %zu fits no trades",
+          max_packet_size);
+    message_.SetAddrFromString(destination_address_str);
+    parity_message_.SetAddrFromString(destination_address_str);
+  }
+
+  // Sends a Parity datagram after every |group_size| datagrams, or none for
+  // 0. Parity datagrams are kParityOverhead bytes larger than the maximum
+  // packet size. Must be set before the first trade.
+  void set_parity_group_size(size_t group_size) {
+    CHECK(next_sequence_ == 1 && count_ == 0);
+    CHECK(group_size <= kMaxParityGroupSize, "parity groups of %zu packets",
+          group_size);
+    CHECK(parity_.max_datagram_size() + kParityOverhead <=
+              parity_message_.max_size(),
+          "no room for parity of %zu byte packets",
+          parity_.max_datagram_size());
+    parity_group_size_ = group_size;
+  }
+
+  // Holds full datagrams back until flush() to send them in one batch.
+  void set_batch_sends(bool batch_sends) {
+    CHECK(!batch_sends || retransmit_ring_.capacity() > kMaxPendingPackets,
+          "batched sends need a retransmit ring of over %zu packets",
+          kMaxPendingPackets);
+    flush();
+    batch_sends_ = batch_sends;
+  }
+
+  // |wss_rx_nanos| is when the trade was received, in nanoseconds since the
+  // epoch.
+  void add(const BinanceTrade& trade, uint64_t wss_rx_nanos) {
+    const uint64_t now = nanos_monotonic();
+    begin_record(encoding_ == TradeEncoding::Raw ? PacketType::Trades
+                                                 : PacketType::CompactTrades,
+                 0, wss_rx_nanos, now);
+    bool full;
+    if (encoding_ == TradeEncoding::Raw) {
+      trades()[count_++] = trade;
+      full = count_ == max_trades_;
+    } else {
+      payload_size_ += codec_.encode(trade, payload() + payload_size_);
+      ++count_;
+      full = payload_size_ + kMaxCompactTradeSize > max_payload_size_ ||
+             count_ == UINT16_MAX;
+    }
+
+    end_record(full, now);
+  }
+
+  void add(const BinanceDepthUpdate& update, uint64_t wss_rx_nanos) {
+    add_message(MessageType::DepthUpdate, kDepthUpdateVersion, &update,
+                message_size(update), wss_rx_nanos);
+  }
+
+  void add(const BinanceBookTicker& ticker, uint64_t wss_rx_nanos) {
+    add_message(MessageType::BookTicker, kBookTickerVersion, &ticker,
+                message_size(ticker), wss_rx_nanos);
+  }
+
+  void add(const BinanceTicker& ticker, uint64_t wss_rx_nanos) {
+    add_message(MessageType::Ticker, kTickerVersion, &ticker,
+                message_size(ticker), wss_rx_nanos);
+  }
+
+  void flush() {
+    seal(false);
+    send_pending();
+  }
+
+  // Sends a Heartbeat if no packet went out since the last call, after
+  // flushing. The sender calls this every few milliseconds.
+  void heartbeat() {
+    flush();
+    if (!sent_since_heartbeat_) {
+      send_record(socket_, hasher_, message_.addr(), PacketType::Heartbeat,
+                  session_, HeartbeatRecord{next_sequence_ - 1}, shard_);
+    }
+    sent_since_heartbeat_ = false;
+  }
+
+  // Settles on a trade encoding with the receiver that sent a verified
+  // Hello packet.
+  void handle_hello(const PacketHeader& header, const UDPMessage& message) {
+    CHECK(header.type == PacketType::Hello);
+    if (header.session != session_) {
+      return;
+    }
+
+    const auto& hello = *packet_records<HelloRecord>(message);
+    TradeEncoding offered = hello.max_trade_encoding;
+    // Only a receiver that knows no more ids than we do can be checked.
+    if (hello.num_symbols <= kNumSymbols &&
+        hello.symbols_digest != symbols_digest(hello.num_symbols)) {
+      fprintf(stderr, "%s: market ids differ from ours\n",
+              message.addr_str().c_str());
+      offered = TradeEncoding::Raw;
+    }
+    const TradeEncoding encoding = std::min(
+        offered, heard_hello_ ? agreed_encoding_ : max_trade_encoding_);
+    const uint32_t num_symbols =
+        std::min<uint32_t>(hello.num_symbols, codec_.num_symbols());
+    heard_hello_ = true;
+    agreed_encoding_ = encoding;
+    if (encoding != encoding_ || num_symbols != codec_.num_symbols()) {
+      fprintf(stderr, "%s: switching to trade encoding %d, %u market ids\n",
+              message.addr_str().c_str(), static_cast<int>(encoding),
+              num_symbols);
+      flush();
+      encoding_ = encoding;
+      codec_.set_num_symbols(num_symbols);
+    }
+  }
+
+  // Resends whatever the receiver asked for in a verified Nack packet that
+  // is still in the retransmit ring.
+  void handle_nack(const PacketHeader& header, const UDPMessage& message) {
+    CHECK(header.type == PacketType::Nack);
+    if (header.session != session_) {
+      return;
+    }
+
+    const auto* ranges = packet_records<SequenceRange>(message);
+    for (size_t i = 0; i < header.count; ++i) {
+      const auto count =
+          std::min<uint64_t>(ranges[i].count, retransmit_ring_.capacity());
+      for (uint64_t sequence = ranges[i].first;
+           sequence < ranges[i].first + count; ++sequence) {
+        // Held back datagrams are not signed yet.
+        const bool sent = pending_.empty() || sequence < pending_.front();
+        if (sent && retransmit_ring_.load(sequence, &retransmit_message_)) {
+          retransmit_message_.CopyAddrFrom(message);
+          socket_->send_one(retransmit_message_);
+          ++retransmitted_;
+        } else {
+          ++retransmit_misses_;
+        }
+      }
+    }
+  }
+
+  // Answers a verified TimeRequest packet with our receive and reply times.
+  void handle_time_request(const PacketHeader& header,
+                           const UDPMessage& message) {
+    CHECK(header.type == PacketType::TimeRequest);
+    if (header.session != session_) {
+      return;
+    }
+
+    ClockSample sample = *packet_records<ClockSample>(message);
+    sample.request_rx_nanos =
+        message.rx_nanos() ? message.rx_nanos() : nanos_since_epoch();
+    sample.reply_tx_nanos = nanos_since_epoch();
+    send_record(socket_, hasher_, message.addr(), PacketType::TimeReply,
+                session_, sample, shard_);
+  }
+
+  size_t max_trades() const { return max_trades_; }
+  std::string addr_str() const { return message_.addr_str(); }
+  // Messages too large for a datagram, which are dropped.
+  uint64_t oversized_messages() const { return oversized_messages_; }
+  uint64_t retransmitted() const { return retransmitted_; }
+  uint64_t retransmit_misses() const { return retransmit_misses_; }
+
+ private:
+  TradePacketWriter(TradePacketWriter&) = delete;
+  TradePacketWriter(TradePacketWriter&&) = delete;
+
+  constexpr static size_t kMaxPendingPackets = UDPSocket::kMaxGsoSegments;
+
+  // Makes room for a record of |type| and |size| bytes, sealing the
+  // datagram so far if it holds another type or has no room left.
+  void begin_record(PacketType type, size_t size, uint64_t wss_rx_nanos,
+                    uint64_t now) {
+    if (count_ > 0 &&
+        (type != packet_type_ || payload_size_ + size > max_payload_size_)) {
+      seal(type == packet_type_);
+    }
+    if (count_ == 0) {
+      packet_type_ = type;
+      first_trade_rx_nanos_ = wss_rx_nanos;
+      if (pending_.empty()) {
+        first_trade_nanos_ = now;
+      }
+    }
+  }
+
+  void end_record(bool full, uint64_t now) {
+    if (full) {
+      seal(true);
+    }
+    if (now - first_trade_nanos_ >= flush_deadline_nanos_) {
+      flush();
+    }
+  }
+
+  void add_message(MessageType type, uint8_t version, const void* body,
+                   size_t size, uint64_t wss_rx_nanos) {
+    const size_t record_size = sizeof(MessageHeader) + size;
+    if (record_size > max_payload_size_) {
+      ++oversized_messages_;
+      return;
+    }
+    const uint64_t now = nanos_monotonic();
+    begin_record(PacketType::Messages, record_size, wss_rx_nanos, now);
+    const MessageHeader header{type, version, 0,
+                               static_cast<uint32_t>(size)};
+    std::memcpy(payload() + payload_size_, &header, sizeof(header));
+    std::memcpy(payload() + payload_size_ + sizeof(header), body, size);
+    payload_size_ += record_size;
+    ++count_;
+    end_record(count_ == UINT16_MAX, now);
+  }
+
+  // Seals the records added so far into a datagram and sends it, or holds
+  // it back with batched sends. A |full| compact datagram is padded.
+  void seal(bool full) {
+    if (count_ == 0) {
+      return;
+    }
+
+    const uint64_t sequence = next_sequence_++;
+    if (packet_type_ == PacketType::Trades) {
+      payload_size_ = count_ * sizeof(BinanceTrade);
+    } else if (packet_type_ == PacketType::CompactTrades && full &&
+               batch_sends_) {
+      std::memset(payload() + payload_size_, 0,
+                  max_payload_size_ - payload_size_);
+      payload_size_ = max_payload_size_;
+    }
+    if (batch_sends_) {
+      // Signed in send_pending().
+      frame_packet(packet_type_, count_, payload_size_, shard_, session_,
+                   sequence, &message_, first_trade_rx_nanos_);
+      retransmit_ring_.store(sequence, message_.data(), message_.size());
+      pending_.push_back(sequence);
+      if (pending_.size() == kMaxPendingPackets) {
+        send_pending();
+      }
+    } else {
+      seal_packet(hasher_, packet_type_, count_, payload_size_, shard_,
+                  session_, sequence, &message_, first_trade_rx_nanos_);
+      retransmit_ring_.store(sequence, message_.data(), message_.size());
+      socket_->send_one(message_);
+      if (add_to_parity(message_.data(), message_.size())) {
+        send_parity(sequence + 1 - parity_group_size_);
+      }
+    }
+    sent_since_heartbeat_ = true;
+    count_ = 0;
+    payload_size_ = 0;
+    codec_.reset();
+  }
+
+  // Signs the datagrams held back by batched sends, all at once, and sends
+  // them straight out of the retransmit ring, each parity group followed by
+  // its Parity datagram.
+  void send_pending() {
+    if (pending_.empty()) {
+      return;
+    }
+    const size_t count = pending_.size();
+    iovec datagrams[kMaxPendingPackets];
+    const uint8_t* inputs[kMaxPendingPackets];
+    size_t sizes[kMaxPendingPackets];
+    uint8_t* signatures[kMaxPendingPackets];
+    for (size_t i = 0; i < count; ++i) {
+      datagrams[i] = retransmit_ring_.find(pending_[i]);
+      CHECK(datagrams[i].iov_base);
+      auto* data = static_cast<uint8_t*>(datagrams[i].iov_base);
+      sizes[i] = datagrams[i].iov_len - kHashSizeBytes;
+      inputs[i] = data;
+      signatures[i] = data + sizes[i];
+    }
+    hasher_->hash_batch(inputs, sizes, count, signatures);
+
+    size_t unsent = 0;
+    for (size_t i = 0; i < count; ++i) {
+      if (add_to_parity(inputs[i], datagrams[i].iov_len)) {
+        socket_->send_batch(datagrams + unsent, i + 1 - unsent,
+                            message_.addr());
+        unsent = i + 1;
+        send_parity(pending_[i] + 1 - parity_group_size_);
+      }
+    }
+    if (unsent < count) {
+      socket_->send_batch(datagrams + unsent, count - unsent,
+                          message_.addr());
+    }
+    pending_.clear();
+  }
+
+  // Adds a signed datagram to the parity group, if any. Returns whether it
+  // completed the group.
+  bool add_to_parity(const uint8_t* data, size_t size) {
+    if (!parity_group_size_) {
+      return false;
+    }
+    parity_.add(data, size);
+    return parity_.count() == parity_group_size_;
+  }
+
+  // Sends the Parity datagram of the |parity_group_size_| datagrams from
+  // |first|, after them.
+  void send_parity(uint64_t first) {
+    const size_t payload_size =
+        parity_.finish(parity_message_.data() + sizeof(PacketHeader));
+    seal_packet(hasher_, PacketType::Parity, parity_group_size_, payload_size,
+                shard_, session_, first, &parity_message_);
+    socket_->send_one(parity_message_);
+  }
+
+  uint8_t* payload() { return message_.data() + sizeof(PacketHeader); }
+  BinanceTrade* trades() { return reinterpret_cast<BinanceTrade*>(payload()); }
+
+  Hasher* const hasher_;
+  UDPSocket* const socket_;
+  const uint8_t shard_;
+  const size_t max_trades_;
+  const size_t max_payload_size_;
+  const TradeEncoding max_trade_encoding_;
+  const uint64_t flush_deadline_nanos_;
+  const uint64_t session_;
+
+  TradeEncoding encoding_ = TradeEncoding::Raw;
+  TradeEncoding agreed_encoding_ = TradeEncoding::Raw;
+  bool heard_hello_ = false;
+  CompactTradeCodec codec_;
+
+  UDPMessage message_;
+  PacketType packet_type_ = PacketType::Trades;
+  size_t count_ = 0;
+  size_t payload_size_ = 0;
+  bool batch_sends_ = false;
+  std::vector<uint64_t> pending_;
+  uint64_t first_trade_nanos_ = 0;
+  uint64_t first_trade_rx_nanos_ = 0;
+  uint64_t next_sequence_ = 1;
+  bool sent_since_heartbeat_ = false;
+
+  RetransmitRing retransmit_ring_;
+  UDPMessage retransmit_message_;
+  uint64_t retransmitted_ = 0;
+  uint64_t retransmit_misses_ = 0;
+  uint64_t oversized_messages_ = 0;
+
+  size_t parity_group_size_ = 0;
+  ParityEncoder parity_;
+  UDPMessage parity_message_;
+};
+
+// When a sender got a trade and sent it on, by our clock, or 0 until we
+// have an estimate of the sender's clock.
+struct SenderTiming {
+  uint64_t wss_rx_nanos;
+  uint64_t send_nanos;
+};
+
+// Verifies and sequences the packets arriving on |socket|, asking
+// senders to retransmit whenever a gap shows up. Duplicates are dropped.
+// Once a sender's Parity packets show up, a packet lost from a parity group
+// is rebuilt as soon as the rest of the group and its parity are in.
+// Senders still sending raw trades are offered |max_trade_encoding| with a
+// Hello about once a second, which covers lost Hellos. Each sender's clock
+// is measured with a round trip every |time_request_interval_nanos|. A
+// sender not heard from, not even a Heartbeat, for |sender_timeout_nanos|
+// is reported silent.
+class TradePacketReader final {
+ public:
+  TradePacketReader(Hasher* hasher, UDPSocket* socket,
+                    TradeEncoding max_trade_encoding = kNewestTradeEncoding,
+                    uint64_t time_request_interval_nanos = 1000000000ULL,
+                    uint64_t sender_timeout_nanos = kDefaultSenderTimeoutNanos)
+      : hasher_(CHECK_NOTNULL(hasher)),
+        socket_(CHECK_NOTNULL(socket)),
+        max_trade_encoding_(max_trade_encoding),
+        time_request_interval_nanos_(time_request_interval_nanos),
+        sender_timeout_nanos_(sender_timeout_nanos) {}
+
+  // Logs senders that just went silent. Call at least every
+  // |sender_timeout_nanos|.
+  void check_senders() {
+    const uint64_t now = nanos_monotonic();
+    for (auto& entry : peers_) {
+      Peer& peer = entry.second;
+      if (!peer.silent && now - peer.heard_nanos >= sender_timeout_nanos_) {
+        fprintf(stderr, "%s: silent for %.1fms\n", peer.addr_str.c_str(),
+                1e-6 * static_cast<double>(now - peer.heard_nanos));
+        peer.silent = true;
+        ++peer.stalls;
+      }
+    }
+  }
+
+  // Writes each sender's clock offset and the round trip it was measured
+  // over, how many lost packets parity repaired, and how many datagrams
+  // were dropped as malformed or forged.
+  void report(FILE* f) const {
+    fprintf(f, "udp: %llu bad packets dropped\n",
+            static_cast<unsigned long long>(dropped_));
+    for (const auto& entry : peers_) {
+      const Peer& peer = entry.second;
+      fprintf(f, "%s: %s, silent %llu times\n", peer.addr_str.c_str(),
+              peer.silent ? "silent" : "live",
+              static_cast<unsigned long long>(peer.stalls));
+      if (peer.clock.valid()) {
+        fprintf(f, "%s: clock offset %.1fus, round trip %.1fus\n",
+                peer.addr_str.c_str(),
+                1e-3 * static_cast<double>(peer.clock.offset_nanos()),
+                1e-3 * static_cast<double>(peer.clock.delay_nanos()));
+      }
+      if (peer.parity) {
+        fprintf(f, "%s: parity repaired %llu, unrecoverable %llu\n",
+                peer.addr_str.c_str(),
+                static_cast<unsigned long long>(peer.parity->repaired()),
+                static_cast<unsigned long long>(peer.parity->unrecoverable()));
+      }
+    }
+  }
+
+  // Counts a datagram dropped before it got here, e.g. by a BatchVerifier.
+  void drop() { ++dropped_; }
+
+  // Calls on_message(record, sender_timing) for every new BinanceTrade,
+  // BinanceDepthUpdate, BinanceBookTicker and BinanceTicker in |message|.
+  // Drops |message| if it is malformed or forged.
+  template <typename Message, typename F>
+  void handle(const Message& message, const F& on_message) {
+    if (!verify_packet(message, hasher_)) {
+      ++dropped_;
+      return;
+    }
+    handle_trusted(message, on_message);
+  }
+
+  // Like handle(), for a |message| whose signature was checked already.
+  template <typename Message, typename F>
+  void handle_trusted(const Message& message, const F& on_message) {
+    const auto* header = check_packet_framing(message);
+    if (!header) {
+      ++dropped_;
+      return;
+    }
+    auto& peer = peers_[message.addr_key()];
+    if (peer.addr_str.empty()) {
+      peer.addr_str = message.addr_str();
+    }
+    peer.heard_nanos = nanos_monotonic();
+    if (peer.silent) {
+      fprintf(stderr, "%s: live again\n", peer.addr_str.c_str());
+      peer.silent = false;
+    }
+    if (header->type == PacketType::TimeReply) {
+      peer.clock.add(
+          *packet_records<ClockSample>(message),
+          message.rx_nanos() ? message.rx_nanos() : nanos_since_epoch());
+      return;
+    }
+    if (header->type == PacketType::Parity) {
+      handle_parity(*header, message, &peer, on_message);
+      return;
+    }
+    SequenceRange gap;
+    if (header->type == PacketType::Heartbeat) {
+      peer.tracker.on_heartbeat(
+          header->session,
+          packet_records<HeartbeatRecord>(message)->last_sequence, &gap);
+      nack(message, header->session, gap);
+      return;
+    }
+    if (!has_records(header->type)) {
+      fprintf(stderr, "unexpected packet type %d from %s\n",
+              static_cast<int>(header->type), peer.addr_str.c_str());
+      ++dropped_;
+      return;
+    }
+
+    const uint64_t now = nanos_monotonic();
+    if (peer.time_request_session != header->session ||
+        now - peer.time_request_nanos >= time_request_interval_nanos_) {
+      send_time_request(socket_, hasher_, message.addr(), header->session);
+      peer.time_request_session = header->session;
+      peer.time_request_nanos = now;
+    }
+    // Compact trades may use ids or an encoding we do not know, so their
+    // sender keeps hearing what we do.
+    if (header->type == PacketType::CompactTrades ||
+        (header->type == PacketType::Trades &&
+         max_trade_encoding_ != TradeEncoding::Raw)) {
+      if (peer.hello_session != header->session ||
+          now - peer.hello_nanos >= kHelloIntervalNanos) {
+        send_hello(socket_, hasher_, message.addr(), header->session,
+                   max_trade_encoding_);
+        peer.hello_session = header->session;
+        peer.hello_nanos = now;
+      }
+    }
+
+    const auto status =
+        peer.tracker.on_packet(header->session, header->sequence, &gap);
+    nack(message, header->session, gap);
+    if (status == SequenceStatus::Duplicate) {
+      return;
+    }
+    if (peer.parity && peer.parity_session == header->session) {
+      peer.parity->add(header->sequence, message.data(), message.size());
+    }
+    if (!decode_records(*header, message, sender_timing(*header, peer),
+                        on_message)) {
+      fprintf(stderr, "malformed packet %llu from %s\n",
+              static_cast<unsigned long long>(header->sequence),
+              peer.addr_str.c_str());
+      ++dropped_;
+    }
+  }
+
+  // Calls on_message(record, sender_timing) for the records in |message|
+  // while its signature is still being checked, and does nothing else with
+  // it: its sequence number, clock samples and answers to its sender wait
+  // for handle_trusted() once the signature checks out. Records of packets
+  // known to be duplicates are skipped, and of malformed ones cut short.
+  // Returns whether it went on to pass on records, which handle_trusted()
+  // then passes on again.
+  template <typename Message, typename F>
+  bool peek(const Message& message, const F& on_message) {
+    const auto* header = check_packet_framing(message);
+    if (!header || !has_records(header->type)) {
+      return false;
+    }
+    const auto it = peers_.find(message.addr_key());
+    if (it == peers_.end()) {
+      decode_records(*header, message, SenderTiming{0, 0}, on_message);
+      return true;
+    }
+    const Peer& peer = it->second;
+    if (peer.tracker.is_duplicate(header->session, header->sequence)) {
+      return false;
+    }
+    decode_records(*header, message, sender_timing(*header, peer),
+                   on_message);
+    return true;
+  }
+
+ private:
+  TradePacketReader(TradePacketReader&) = delete;
+  TradePacketReader(TradePacketReader&&) = delete;
+
+  constexpr static uint64_t kHelloIntervalNanos = 1000000000ULL;
+
+  struct Peer {
+    std::string addr_str;
+    SequenceTracker tracker;
+    ClockOffsetEstimator clock;
+    uint64_t hello_session = 0;
+    uint64_t hello_nanos = 0;
+    uint64_t time_request_session = 0;
+    uint64_t time_request_nanos = 0;
+    std::unique_ptr<ParityDecoder> parity;
+    uint64_t parity_session = 0;
+    uint64_t heard_nanos = 0;
+    bool silent = false;
+    uint64_t stalls = 0;
+  };
+
+  static bool has_records(PacketType type) {
+    return type == PacketType::Trades || type == PacketType::CompactTrades ||
+           type == PacketType::Messages;
+  }
+
+  SenderTiming sender_timing(const PacketHeader& header,
+                             const Peer& peer) const {
+    return peer.clock.valid()
+               ? SenderTiming{peer.clock.to_local(header.wss_rx_nanos),
+                              peer.clock.to_local(header.send_nanos)}
+               : SenderTiming{0, 0};
+  }
+
+  // Calls on_message(record, timing) for each record in |message|, a
+  // packet of Trades, CompactTrades or Messages. Returns false, having
+  // passed on the records before it, at the first malformed one.
+  template <typename Message, typename F>
+  bool decode_records(const PacketHeader& header, const Message& message,
+                      const SenderTiming& timing, const F& on_message) {
+    if (header.type == PacketType::Trades) {
+      const auto* trades = packet_records<BinanceTrade>(message);
+      for (size_t i = 0; i < header.count; ++i) {
+        on_message(trades[i], timing);
+      }
+      return true;
+    }
+
+    const uint8_t* in = message.data() + sizeof(PacketHeader);
+    const uint8_t* const end = message.data() + message.size() - kHashSizeBytes;
+    if (header.type == PacketType::Messages) {
+      for (size_t i = 0; i < header.count; ++i) {
+        MessageHeader record;
+        if (static_cast<size_t>(end - in) < sizeof(record)) {
+          return false;
+        }
+        std::memcpy(&record, in, sizeof(record));
+        in += sizeof(record);
+        if (record.size % 8 != 0 ||
+            static_cast<size_t>(end - in) < record.size ||
+            !decode_message(record, in, timing, on_message)) {
+          return false;
+        }
+        in += record.size;
+      }
+      return in == end;
+    }
+
+    codec_.reset();
+    BinanceTrade trade;
+    for (size_t i = 0; i < header.count; ++i) {
+      if (!codec_.decode(&in, end, &trade)) {
+        return false;
+      }
+      on_message(trade, timing);
+    }
+    for (; in < end; ++in) {
+      if (*in != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Calls on_message(record, timing) with the message of |header| at |in|,
+  // unless it is of a type we do not know. Returns false if it is too short
+  // for its type.
+  template <typename F>
+  bool decode_message(const MessageHeader& header, const uint8_t* in,
+                      const SenderTiming& timing, const F& on_message) {
+    if (header.type == MessageType::DepthUpdate) {
+      constexpr size_t kFixedSize = offsetof(BinanceDepthUpdate, levels);
+      if (header.size < kFixedSize) {
+        return false;
+      }
+      std::memcpy(&depth_update_, in, kFixedSize);
+      const size_t num_levels =
+          depth_update_.num_bids + depth_update_.num_asks;
+      if (num_levels > kMaxDepthLevels ||
+          header.size < message_size(depth_update_) ||
+          depth_update_.part >= depth_update_.num_parts) {
+        return false;
+      }
+      std::memcpy(depth_update_.levels, in + kFixedSize,
+                  num_levels * sizeof(PriceLevel));
+      depth_update_.market[sizeof(depth_update_.market) - 1] = '\0';
+      on_message(depth_update_, timing);
+    } else if (header.type == MessageType::BookTicker) {
+      BinanceBookTicker ticker;
+      if (header.size < sizeof(ticker)) {
+        return false;
+      }
+      std::memcpy(&ticker, in, sizeof(ticker));
+      ticker.market[sizeof(ticker.market) - 1] = '\0';
+      on_message(ticker, timing);
+    } else if (header.type == MessageType::Ticker) {
+      BinanceTicker ticker;
+      if (header.size < sizeof(ticker)) {
+        return false;
+      }
+      std::memcpy(&ticker, in, sizeof(ticker));
+      ticker.market[sizeof(ticker.market) - 1] = '\0';
+      on_message(ticker, timing);
+    }
+    return true;
+  }
+
+  // Asks the sender of |message| for the packets in |gap|, if any.
+  template <typename Message>
+  void nack(const Message& message, uint64_t session,
+            const SequenceRange& gap) {
+    if (gap.count) {
+      fprintf(stderr, "%s: missing %llu packets from %llu, sending nack\n",
+              message.addr_str().c_str(),
+              static_cast<unsigned long long>(gap.count),
+              static_cast<unsigned long long>(gap.first));
+      send_nack(socket_, hasher_, message.addr(), session, gap);
+    }
+  }
+
+  // Rebuilds the packet missing from the group covered by a verified Parity
+  // packet, if it is the only one, and handles it.
+  template <typename Message, typename F>
+  void handle_parity(const PacketHeader& header, const Message& message,
+                     Peer* peer, const F& on_message) {
+    if (!peer->parity || peer->parity_session != header.session) {
+      peer->parity.reset(new ParityDecoder{UDPMessage::kBufferSize});
+      peer->parity_session = header.session;
+    }
+    const iovec repaired = peer->parity->repair(
+        header.sequence, header.count, packet_records<uint8_t>(message),
+        message.size() - packet_size(PacketType::Parity, 0));
+    if (!repaired.iov_base) {
+      return;
+    }
+    const UDPPacketView view{static_cast<const uint8_t*>(repaired.iov_base),
+                             repaired.iov_len, message.addr(),
+                             message.rx_nanos()};
+    if (verify_packet(view, hasher_)) {
+      handle_trusted(view, on_message);
+    }
+  }
+
+  Hasher* const hasher_;
+  UDPSocket* const socket_;
+  const TradeEncoding max_trade_encoding_;
+  const uint64_t time_request_interval_nanos_;
+  const uint64_t sender_timeout_nanos_;
+  std::unordered_map<uint64_t, Peer> peers_;
+  CompactTradeCodec codec_;
+  BinanceDepthUpdate depth_update_;
+  uint64_t dropped_ = 0;
+};
+
+}  // namespace opentoken
+
+#endif  // _OPENTOKEN__HARE__PROTOCOL_H_
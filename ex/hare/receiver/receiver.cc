@@ -1,125 +1,608 @@
+#include "arbiter.h"
 #include "binance.h"
 #include "binance_wss.h"
+#include "event_loop.h"
 #include "hasher.h"
+#include "message_pool.h"
 #include "network.h"
+#include "packet_ring.h"
+#include "protocol.h"
 #include "timing.h"
 #include "util.h"
+#include "verifier.h"
 
 #include <netinet/in.h>
 #include <sys/ioctl.h>
-#include <sys/poll.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 namespace opentoken {
 namespace {
 using namespace std;
 
-bool check_in_event(const pollfd* fds, int pos) {
-  const auto revents = fds[pos].revents;
-  if (!revents) {
-    return false;
-  } else if (revents & POLLIN) {
-    return true;
-  } else if (revents & POLLERR) {
-    FAIL("pollerr on file %d", pos);
-  } else if (revents & POLLHUP) {
-    FAIL("pollhup on file %d", pos);
-  } else {
-    FAIL("What happened? file %d %d", pos, revents);
+// Formats |record| as the start of a JSON object, without the closing
+// brace, into |buffer|. Returns the bytes written.
+size_t format_json(const BinanceTrade& trade, char* buffer, size_t size) {
+  const auto bytes_written = snprintf(
+      buffer, size, R"({"p":%.17g,"q":%.17g,"t":%llu,"T":%llu,"s":"%s")",
+      trade.price, trade.quantity,
+      static_cast<unsigned long long>(trade.trade_id),
+      static_cast<unsigned long long>(trade.trade_time), trade.market);
+  CHECK(bytes_written > 0 && static_cast<size_t>(bytes_written) < size);
+  return static_cast<size_t>(bytes_written);
+}
+
+size_t format_price_levels(const PriceLevel* levels, size_t count,
+                           char* buffer, size_t size) {
+  size_t length = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const auto bytes_written =
+        snprintf(buffer + length, size - length, "%s[%.17g,%.17g]",
+                 i ? "," : "", levels[i].price, levels[i].quantity);
+    CHECK(bytes_written > 0 &&
+          static_cast<size_t>(bytes_written) < size - length);
+    length += static_cast<size_t>(bytes_written);
   }
+  return length;
+}
+
+size_t format_json(const BinanceDepthUpdate& update, char* buffer,
+                   size_t size) {
+  auto bytes_written = snprintf(
+      buffer, size,
+      R"({"e":"depthUpdate","E":%llu,"s":"%s","U":%llu,"u":%llu,)"
+      R"("part":%u,"parts":%u,"b":[)",
+      static_cast<unsigned long long>(update.event_time), update.market,
+      static_cast<unsigned long long>(update.first_update_id),
+      static_cast<unsigned long long>(update.final_update_id),
+      static_cast<unsigned>(update.part),
+      static_cast<unsigned>(update.num_parts));
+  CHECK(bytes_written > 0 && static_cast<size_t>(bytes_written) < size);
+  size_t length = static_cast<size_t>(bytes_written);
+  length += format_price_levels(update.levels, update.num_bids,
+                                buffer + length, size - length);
+  bytes_written = snprintf(buffer + length, size - length, R"(],"a":[)");
+  CHECK(bytes_written > 0 &&
+        static_cast<size_t>(bytes_written) < size - length);
+  length += static_cast<size_t>(bytes_written);
+  length += format_price_levels(update.levels + update.num_bids,
+                                update.num_asks, buffer + length,
+                                size - length);
+  CHECK(length + 1 < size);
+  buffer[length++] = ']';
+  return length;
+}
+
+size_t format_json(const BinanceBookTicker& ticker, char* buffer,
+                   size_t size) {
+  const auto bytes_written = snprintf(
+      buffer, size,
+      R"({"e":"bookTicker","u":%llu,"s":"%s","b":%.17g,"B":%.17g,"a":%.17g,"A":%.17g)",
+      static_cast<unsigned long long>(ticker.update_id), ticker.market,
+      ticker.bid_price, ticker.bid_quantity, ticker.ask_price,
+      ticker.ask_quantity);
+  CHECK(bytes_written > 0 && static_cast<size_t>(bytes_written) < size);
+  return static_cast<size_t>(bytes_written);
 }
 
-void write_json_to_file(PosixFile* f, const BinanceTrade& trade,
-                        const char* source) {
+size_t format_json(const BinanceTicker& ticker, char* buffer, size_t size) {
+  const auto bytes_written = snprintf(
+      buffer, size,
+      R"({"e":"24hrTicker","E":%llu,"s":"%s","p":%.17g,"P":%.17g,)"
+      R"("w":%.17g,"x":%.17g,"c":%.17g,"Q":%.17g,"b":%.17g,"B":%.17g,)"
+      R"("a":%.17g,"A":%.17g,"o":%.17g,"h":%.17g,"l":%.17g,"v":%.17g,)"
+      R"("q":%.17g,"O":%llu,"C":%llu,"F":%lld,"L":%lld,"n":%llu)",
+      static_cast<unsigned long long>(ticker.event_time), ticker.market,
+      ticker.price_change, ticker.price_change_percent,
+      ticker.weighted_avg_price, ticker.prev_close_price, ticker.last_price,
+      ticker.last_quantity, ticker.bid_price, ticker.bid_quantity,
+      ticker.ask_price, ticker.ask_quantity, ticker.open_price,
+      ticker.high_price, ticker.low_price, ticker.volume, ticker.quote_volume,
+      static_cast<unsigned long long>(ticker.open_time),
+      static_cast<unsigned long long>(ticker.close_time),
+      static_cast<long long>(ticker.first_trade_id),
+      static_cast<long long>(ticker.last_trade_id),
+      static_cast<unsigned long long>(ticker.num_trades));
+  CHECK(bytes_written > 0 && static_cast<size_t>(bytes_written) < size);
+  return static_cast<size_t>(bytes_written);
+}
+
+// Writes |record| as one JSON line. Trades have the exchange's fields;
+// depth updates and tickers also carry their event type in "e", and depth
+// updates which of their "parts" they are.
+// |rx_nanos| is when the kernel received the record, or 0 if unknown.
+// |sender| is when a UDP sender received and sent it on, by our clock.
+template <typename Record>
+void write_json_to_file(PosixFile* f, const Record& record,
+                        const char* source, const char* feed,
+                        uint64_t rx_nanos, const SenderTiming& sender) {
   const uint64_t time_nanos_epoch = nanos_since_epoch();
   const uint64_t time_nanos_raw = nanos_monotonic_raw();
   const uint64_t time_nanos_mono = nanos_monotonic();
 
-  constexpr size_t kMaxJsonSize = 1024;
+  // Enough for a depth update of kMaxDepthLevels levels.
+  constexpr size_t kMaxJsonSize = 8192;
   char buffer[kMaxJsonSize];
+  size_t length = format_json(record, buffer, sizeof(buffer));
+  const auto bytes_written = snprintf(
+      buffer + length, sizeof(buffer) - length,
+      R"(,"epochNanos":%llu,"rawNanos":%llu,"monoNanos":%llu,"rxNanos":%llu,"senderRxNanos":%llu,"senderTxNanos":%llu,"source":"%s","feed":"%s"})"
+      "\n",
+      static_cast<unsigned long long>(time_nanos_epoch),
+      static_cast<unsigned long long>(time_nanos_raw),
+      static_cast<unsigned long long>(time_nanos_mono),
+      static_cast<unsigned long long>(rx_nanos),
+      static_cast<unsigned long long>(sender.wss_rx_nanos),
+      static_cast<unsigned long long>(sender.send_nanos), source, feed);
+  CHECK(bytes_written > 0 &&
+        static_cast<size_t>(bytes_written) < sizeof(buffer) - length);
+  length += static_cast<size_t>(bytes_written);
+  write(f->fd(), buffer, length);
+}
+
+// Flags a datagram whose records were written before its signature turned
+// out bad, so that readers of the output can drop them.
+void write_bad_signature_to_file(PosixFile* f, const UDPMessage& message,
+                                 const char* feed) {
+  const auto* header = reinterpret_cast<const PacketHeader*>(message.data());
+  char buffer[256];
   const auto bytes_written = snprintf(
       buffer, sizeof(buffer),
-      R"({"p":%.17g,"q":%.17g,"t":%llu,"T":%llu,"s":"%s","epochNanos":%llu,"rawNanos":%llu,"monoNanos":%llu,"source":"%s"})"
+      R"({"e":"badSignature","session":%llu,"sequence":%llu,"epochNanos":%llu,"feed":"%s"})"
       "\n",
-      trade.price, trade.quantity, trade.trade_id, trade.trade_time,
-      trade.market, time_nanos_epoch, time_nanos_raw, time_nanos_mono, source);
+      static_cast<unsigned long long>(header->session),
+      static_cast<unsigned long long>(header->sequence),
+      static_cast<unsigned long long>(nanos_since_epoch()), feed);
   CHECK(bytes_written > 0 &&
         static_cast<size_t>(bytes_written) < sizeof(buffer));
   write(f->fd(), buffer, static_cast<size_t>(bytes_written));
 }
 
-void process_stdin(const char* output_path, const char* wss_input_uri,
-                   int recv_port) {
-  using namespace std;
+vector<string> split(const string& s, char delimiter) {
+  vector<string> result;
+  size_t begin = 0;
+  while (true) {
+    const auto end = s.find(delimiter, begin);
+    result.push_back(s.substr(begin, end - begin));
+    if (end == string::npos) {
+      return result;
+    }
+    begin = end + 1;
+  }
+}
+
+// Doubles the receive buffer of |socket|, up to |*max_bytes|, after the
+// kernel dropped datagrams for lack of room in it. Sets |*max_bytes| to 0 to
+// stop trying when the kernel grants no more.
+void grow_receive_buffer(UDPSocket* socket, size_t* max_bytes, size_t shard) {
+  const size_t size = socket->receive_buffer();
+  if (size >= *max_bytes) {
+    return;
+  }
+  const size_t granted =
+      socket->set_receive_buffer(std::min(2 * size, *max_bytes));
+  if (granted <= size) {
+    fprintf(stderr,
+            "shard %zu: receive buffer stuck at %zu bytes, raise "
+            "net.core.rmem_max\n",
+            shard, size);
+    *max_bytes = 0;
+    return;
+  }
+  fprintf(stderr, "shard %zu: kernel drops, receive buffer grown to %zu\n",
+          shard, granted);
+}
+
+// Runs one receive loop over |socket| and the WSS connections, writing to
+// |output_path|. When |ring| is set, UDP datagrams are read from it instead
+// and |socket| only sends Nacks. When the receiver is split into
+// |num_shards| threads, each one only keeps the WSS trades of markets in its
+// own |shard|; the UDP socket or ring is already steered to carry only
+// those.
+void run_shard(const string& output_path, const vector<string>& wss_input_uris,
+               UDPSocket* socket, PacketRing* ring, size_t shard,
+               size_t num_shards) {
   Hasher hasher{getenv("SECRET_MESSAGE_KEY")};
   PosixFile output_file{output_path, O_WRONLY};
 
-  UDPMessage in_message{};
-  UDPSocket socket{recv_port};
+  // With arbitration only the first copy of each trade is written. Without
+  // it every copy is, which is what analyze.py needs to compare feeds.
+  const bool arbitrate = getenv_uint("HARE_ARBITRATE", 1);
+  TradeArbiter arbiter{getenv_uint("HARE_DEDUP_WINDOW", 1 << 16)};
+  const int report_interval_ms =
+      static_cast<int>(1000 * getenv_uint("HARE_REPORT_INTERVAL_S", 60));
+  // A live sender is heard from at least every two of its heartbeat
+  // intervals, which should match its HARE_HEARTBEAT_MS, so one not heard
+  // from for three is down or cut off. Checked three times per timeout, so
+  // that it shows within a third more.
+  const uint64_t heartbeat_ms =
+      getenv_uint("HARE_HEARTBEAT_MS", kDefaultHeartbeatMs);
+  const int sender_timeout_ms = static_cast<int>(
+      getenv_uint("HARE_SENDER_TIMEOUT_MS", 3 * heartbeat_ms));
+  CHECK(sender_timeout_ms > 0);
+  // Sources race on kernel receive time where available so the comparison
+  // is not skewed by which socket we happened to service first. Takes a
+  // BinanceTrade, BinanceDepthUpdate, BinanceBookTicker or BinanceTicker.
+  // A record that was |written| before its datagram's signature checked out
+  // is only counted.
+  const auto on_message = [&](const auto& record, size_t source,
+                              const char* kind, uint64_t rx_nanos,
+                              const SenderTiming& sender, bool written) {
+    const uint64_t arrival_nanos = rx_nanos ? rx_nanos : nanos_since_epoch();
+    if ((arbiter.arrive(record, source, arrival_nanos) || !arbitrate) &&
+        !written) {
+      write_json_to_file(&output_file, record, kind,
+                         arbiter.source_name(source).c_str(), rx_nanos,
+                         sender);
+    }
+  };
 
-  BinanceWSSReader reader{wss_input_uri,
-                          [&output_file](const BinanceTrade& trade) {
-                            write_json_to_file(&output_file, trade, "wss");
-                          }};
+  // With HARE_VERIFY_THREADS set, the signatures of datagrams read from
+  // the socket are checked in batches on that many threads while this one
+  // reads on. Their records are then written in arrival order once the
+  // batch checks out, or with HARE_VERIFY_OPTIMISTIC right away, followed
+  // by a "badSignature" line for any datagram that turns out forged. Only
+  // the writing is optimistic: a datagram is sequenced, answered and
+  // arbitrated once it checks out, so copies of a record that arrive while
+  // the first is being checked are all written.
+  // Datagrams from a packet ring or read with GRO are checked inline.
+  const size_t verify_threads = getenv_uint("HARE_VERIFY_THREADS", 0);
+  const bool optimistic = getenv_uint("HARE_VERIFY_OPTIMISTIC", 0);
 
-  while (!reader.has_fd()) {
-    reader.poll();
+  // Batches being verified hold on to their messages.
+  constexpr size_t kReceiveBatchSize = UDPSocket::kMaxBatchSize;
+  UDPMessagePool message_pool{getenv_uint(
+      "HARE_MESSAGE_POOL_SIZE", (verify_threads ? 16 : 4) * kReceiveBatchSize)};
+  deque<unique_ptr<BatchVerifier::Batch>> verifying;
+  vector<unique_ptr<BatchVerifier::Batch>> free_batches;
+  // Declared after the batches, so that it stops before they go away.
+  unique_ptr<BatchVerifier> verifier;
+  if (verify_threads && !ring) {
+    verifier.reset(
+        new BatchVerifier{getenv("SECRET_MESSAGE_KEY"), verify_threads});
   }
+  TradePacketReader packet_reader{
+      &hasher, socket, getenv_trade_encoding(),
+      1000000 * getenv_uint("HARE_TIME_REQUEST_INTERVAL_MS", 1000),
+      1000000ULL * static_cast<uint64_t>(sender_timeout_ms)};
+  // Every sender address is its own source, added once it sends a record
+  // that checks out.
+  unordered_map<uint64_t, size_t> udp_sources;
+  const auto udp_source = [&](const auto& in_message) {
+    auto it = udp_sources.find(in_message.addr_key());
+    if (it == udp_sources.end()) {
+      const size_t source = arbiter.add_source("udp:" + in_message.addr_str());
+      it = udp_sources.emplace(in_message.addr_key(), source).first;
+    }
+    return it->second;
+  };
+  const auto udp_source_name = [&](const UDPMessage& in_message) {
+    const auto it = udp_sources.find(in_message.addr_key());
+    return it != udp_sources.end() ? arbiter.source_name(it->second)
+                                   : "udp:" + in_message.addr_str();
+  };
+  // Takes a UDPMessage or a UDPPacketView. Checks the signature unless
+  // |trusted|. With |peeked| set, its own records were written already.
+  const auto handle_udp_message = [&](const auto& in_message, bool trusted,
+                                      bool peeked) {
+    const auto on_record = [&](const auto& record,
+                               const SenderTiming& sender) {
+      on_message(record, udp_source(in_message), "udp",
+                 in_message.rx_nanos(), sender, peeked);
+    };
+    if (trusted) {
+      packet_reader.handle_trusted(in_message, on_record);
+    } else {
+      packet_reader.handle(in_message, on_record);
+    }
+  };
+  const auto on_udp_message = [&](const auto& in_message) {
+    handle_udp_message(in_message, false, false);
+  };
+  // Writes the records of |in_message| before its signature is checked,
+  // unless a copy that checked out was written already. Returns whether it
+  // went on to write them.
+  const auto peek_udp_message = [&](const UDPMessage& in_message) {
+    const string feed = udp_source_name(in_message);
+    return packet_reader.peek(
+        in_message, [&](const auto& record, const SenderTiming& sender) {
+          if (!arbitrate || !arbiter.seen(record)) {
+            write_json_to_file(&output_file, record, "udp", feed.c_str(),
+                               in_message.rx_nanos(), sender);
+          }
+        });
+  };
 
-  const int timeout = -1;
-  pollfd fds[] = {
-      {
-          .fd = socket.fd(),
-          .events = POLLIN,
-      },
-      {
-          .fd = reader.fd(),
-          .events = POLLIN,
-      },
+  // Handles the batches at the front of |verifying| that are done.
+  const auto finish_verified = [&]() {
+    while (!verifying.empty() &&
+           verifying.front()->done.load(std::memory_order_acquire)) {
+      auto& batch = *verifying.front();
+      for (size_t i = 0; i < batch.count; ++i) {
+        const UDPMessage& in_message = *batch.messages[i];
+        if (batch.valid[i]) {
+          handle_udp_message(in_message, true, optimistic && batch.peeked[i]);
+          continue;
+        }
+        fprintf(stderr, "bad signature on packet from %s\n",
+                in_message.addr_str().c_str());
+        packet_reader.drop();
+        if (optimistic && batch.peeked[i]) {
+          write_bad_signature_to_file(&output_file, in_message,
+                                      udp_source_name(in_message).c_str());
+        }
+      }
+      message_pool.release_many(batch.handles, batch.count);
+      free_batches.push_back(std::move(verifying.front()));
+      verifying.pop_front();
+    }
+  };
+  // Reads what is queued on the socket into batches for |verifier|. Returns
+  // false if it had to stop because every message is in a batch being
+  // verified.
+  const auto receive_to_verify = [&]() {
+    size_t num_acquired, num_received;
+    do {
+      finish_verified();
+      if (free_batches.empty()) {
+        free_batches.emplace_back(new BatchVerifier::Batch{});
+      }
+      auto& batch = *free_batches.back();
+      num_acquired = message_pool.acquire_many(batch.handles,
+                                               kReceiveBatchSize);
+      if (num_acquired == 0) {
+        CHECK(!verifying.empty(), "message pool exhausted");
+        return false;
+      }
+      for (size_t i = 0; i < num_acquired; ++i) {
+        batch.messages[i] = &message_pool.get(batch.handles[i]);
+      }
+      num_received = socket->receive_many(batch.messages, num_acquired);
+      message_pool.release_many(batch.handles + num_received,
+                                num_acquired - num_received);
+      batch.count = num_received;
+      if (num_received == 0) {
+        break;
+      }
+      if (optimistic) {
+        for (size_t i = 0; i < num_received; ++i) {
+          batch.peeked[i] = peek_udp_message(*batch.messages[i]);
+        }
+      }
+      verifier->submit(&batch);
+      verifying.push_back(std::move(free_batches.back()));
+      free_batches.pop_back();
+    } while (num_received == num_acquired);
+    return true;
   };
 
-  while (true) {
-    const int rc = poll(fds, sizeof(fds) / sizeof(fds[0]), timeout);
-    if (rc < 0) {
-      if (errno == EAGAIN || errno == EINTR || errno) {
-        fprintf(stderr, "Error %d\n", errno);
-        continue;
-      } else {
-        FAIL("errno %d", errno);
+  // With HARE_UDP_GRO set, datagrams of a sender that arrive together are
+  // read in one coalesced receive and split up here.
+  vector<uint8_t> coalesced_buffer;
+  if (!ring && getenv_uint("HARE_UDP_GRO", 0)) {
+    if (socket->enable_gro()) {
+      coalesced_buffer.resize(1 << 16);
+    } else {
+      fprintf(stderr, "shard %zu: UDP GRO unavailable\n", shard);
+    }
+  }
+
+  // Every source of work on this thread shares one event loop.
+  EventLoop loop;
+  vector<unique_ptr<BinanceWSSReader>> readers;
+  for (const auto& uri : wss_input_uris) {
+    const size_t source = arbiter.add_source("wss" + to_string(readers.size()));
+    fprintf(stderr, "shard %zu %s: %s\n", shard,
+            arbiter.source_name(source).c_str(), uri.c_str());
+    const size_t index = readers.size();
+    readers.emplace_back(new BinanceWSSReader{
+        &loop, uri.c_str(),
+        [&on_message, &readers, index, source, shard,
+         num_shards](const auto& record) {
+          if (market_shard(record.market, num_shards) == shard) {
+            on_message(record, source, "wss", readers[index]->rx_nanos(),
+                       SenderTiming{0, 0}, false);
+          }
+        }});
+  }
+
+  // With HARE_RCVBUF_MAX set, the receive buffer grows up to that size
+  // whenever the kernel drops datagrams for lack of room.
+  size_t max_receive_buffer = getenv_uint("HARE_RCVBUF_MAX", 0);
+  uint64_t kernel_drops = 0;
+
+  loop.on_readable(ring ? ring->fd() : socket->fd(), [&]() {
+    if (ring) {
+      ring->receive_many(on_udp_message);
+      return;
+    }
+    if (!coalesced_buffer.empty()) {
+      while (socket->receive_coalesced(coalesced_buffer.data(),
+                                       coalesced_buffer.size(),
+                                       on_udp_message) > 0) {
       }
-    } else if (rc == 0) {
-      // timeout
-      fprintf(stderr, "timeout\n");
-      continue;
+    } else if (verifier) {
+      if (!receive_to_verify()) {
+        // Reading on waits for a batch to be done and free its messages.
+        loop.watch_readable(socket->fd(), false);
+      }
+    } else {
+      // Drain everything queued on the socket before going back to wait.
+      UDPMessagePool::Handle handles[kReceiveBatchSize];
+      UDPMessage* in_messages[kReceiveBatchSize];
+      size_t num_acquired, num_received;
+      do {
+        num_acquired = message_pool.acquire_many(handles, kReceiveBatchSize);
+        CHECK(num_acquired > 0, "message pool exhausted");
+        for (size_t i = 0; i < num_acquired; ++i) {
+          in_messages[i] = &message_pool.get(handles[i]);
+        }
+        num_received = socket->receive_many(in_messages, num_acquired);
+        for (size_t i = 0; i < num_received; ++i) {
+          on_udp_message(*in_messages[i]);
+        }
+        message_pool.release_many(handles, num_acquired);
+      } while (num_received == num_acquired);
+    }
+    if (socket->kernel_drops() != kernel_drops) {
+      kernel_drops = socket->kernel_drops();
+      grow_receive_buffer(socket, &max_receive_buffer, shard);
+    }
+  });
+
+  if (verifier) {
+    loop.on_readable(verifier->fd(), [&]() {
+      verifier->clear_fd();
+      finish_verified();
+      loop.watch_readable(socket->fd(), true);
+    });
+  }
+
+  uint64_t next_report_nanos =
+      nanos_monotonic() + 1000000ULL * report_interval_ms;
+  const int check_interval_ms =
+      std::min(report_interval_ms, std::max(1, sender_timeout_ms / 3));
+  loop.every(check_interval_ms, [&]() {
+    packet_reader.check_senders();
+    if (nanos_monotonic() < next_report_nanos) {
+      return;
+    }
+    fprintf(stderr, "shard %zu:\n", shard);
+    arbiter.report(stderr);
+    for (size_t i = 0; i < readers.size(); ++i) {
+      readers[i]->report(stderr, ("wss" + to_string(i)).c_str());
+    }
+    packet_reader.report(stderr);
+    message_pool.report(stderr);
+    if (ring) {
+      const auto stats = ring->stats();
+      fprintf(stderr, "packet ring: %llu packets, %llu dropped\n",
+              static_cast<unsigned long long>(stats.packets),
+              static_cast<unsigned long long>(stats.drops));
+    } else {
+      fprintf(stderr, "socket: %llu dropped by the kernel, %zu byte buffer\n",
+              static_cast<unsigned long long>(kernel_drops),
+              socket->receive_buffer());
     }
+    next_report_nanos = nanos_monotonic() + 1000000ULL * report_interval_ms;
+  });
+
+  loop.run();
+}
+
+void process_stdin(const char* output_paths_str, const char* wss_input_uris_str,
+                   int recv_port) {
+  using namespace std;
+  const auto output_paths = split(output_paths_str, ',');
+  const auto wss_input_uris = split(wss_input_uris_str, ',');
+
+  // Sharding needs the same HARE_SHARDS on the senders, which split their
+  // markets across that many streams.
+  const size_t num_shards = getenv_uint("HARE_SHARDS", 1);
+  CHECK(num_shards > 0 && num_shards <= 256, "bad shard count %zu",
+        num_shards);
+  CHECK(output_paths.size() == num_shards,
+        "%zu shards need as many comma separated output paths, got %zu",
+        num_shards, output_paths.size());
+  constexpr uint64_t kNoPinning = ~0ULL;
+  const uint64_t first_cpu = getenv_uint("HARE_FIRST_CPU", kNoPinning);
+
+  // With HARE_MULTICAST_GROUP set, senders multicast to that group and
+  // every socket joins it, on the interface with address HARE_MULTICAST_IF
+  // if that is set. Other receivers on this host can then share the port.
+  const char* multicast_group = getenv("HARE_MULTICAST_GROUP");
+  const char* multicast_iface = getenv("HARE_MULTICAST_IF");
+  const bool multicast = multicast_group && *multicast_group;
 
-    if (check_in_event(fds, 0)) {
-      socket.receive_one(&in_message);
-      CHECK(in_message.size() == sizeof(TradeMessage));
-      const TradeMessage& trade_message =
-          *reinterpret_cast<const TradeMessage*>(in_message.data());
-      CHECK(hasher.is_valid_signature(
-          reinterpret_cast<const uint8_t*>(&trade_message.trade),
-          sizeof(trade_message.trade), trade_message.signature));
-      write_json_to_file(&output_file, trade_message.trade, "udp");
+  // Sockets join the SO_REUSEPORT group in shard order, which is the order
+  // the steering program indexes them in.
+  // HARE_RCVBUF sizes each socket's kernel receive buffer, which bursts
+  // overflow silently at the kernel's default. Drops are counted either way.
+  const size_t receive_buffer = getenv_uint("HARE_RCVBUF", 0);
+  vector<unique_ptr<UDPSocket>> sockets;
+  for (size_t shard = 0; shard < num_shards; ++shard) {
+    sockets.emplace_back(new UDPSocket{recv_port, num_shards > 1 || multicast});
+    sockets.back()->enable_drop_counter();
+    if (receive_buffer) {
+      sockets.back()->set_receive_buffer(receive_buffer);
     }
+  }
+  if (multicast) {
+    for (size_t shard = 0; shard < num_shards; ++shard) {
+      sockets[shard]->join_multicast_group(
+          multicast_group,
+          multicast_iface && *multicast_iface ? multicast_iface : "0.0.0.0");
+#ifdef __linux__
+      if (num_shards > 1) {
+        attach_shard_filter(sockets[shard].get(), shard, num_shards);
+      }
+#endif
+    }
+  }
+#ifdef __linux__
+  else if (num_shards > 1) {
+    attach_shard_steering(sockets[0].get(), num_shards);
+  }
+#endif
 
-    if (check_in_event(fds, 1)) {
-      reader.poll();
+  // With HARE_PACKET_RING_IFACE set, e.g. to "lo" or "eth0", UDP is read
+  // from a PacketRing per shard on that interface. The sockets stay bound
+  // to send Nacks from the right port but drop whatever they receive.
+  vector<unique_ptr<PacketRing>> rings(num_shards);
+  const char* ring_iface = getenv("HARE_PACKET_RING_IFACE");
+  if (ring_iface && *ring_iface) {
+    const auto num_blocks = getenv_uint("HARE_PACKET_RING_BLOCKS", 64);
+    const auto retire_timeout_ms =
+        static_cast<unsigned>(getenv_uint("HARE_PACKET_RING_RETIRE_MS", 1));
+    for (size_t shard = 0; shard < num_shards; ++shard) {
+      rings[shard].reset(new PacketRing{ring_iface, recv_port, num_blocks,
+                                        retire_timeout_ms});
+#ifdef __linux__
+      sock_filter drop_all[] = {BPF_STMT(BPF_RET | BPF_K, 0)};
+      sockets[shard]->attach_filter(drop_all, 1);
+      if (num_shards > 1) {
+        // Fanout groups are per host, so the port doubles as the group id.
+        attach_shard_steering(rings[shard].get(),
+                              static_cast<uint16_t>(recv_port), num_shards);
+      }
+#endif
     }
   }
+
+  init_openssl_threading();
+  vector<thread> workers;
+  for (size_t shard = 0; shard < num_shards; ++shard) {
+    workers.emplace_back([&, shard]() {
+      if (first_cpu != kNoPinning) {
+        pin_thread_to_cpu(first_cpu + shard);
+      }
+      run_shard(output_paths[shard], wss_input_uris, sockets[shard].get(),
+                rings[shard].get(), shard, num_shards);
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
 }
 
 }  // namespace
 }  // namespace opentoken
 
 int main(int argc, const char** argv) {
+  // One output path per shard, comma separated.
   const auto output_path = argc < 2 ? "/dev/stdout" : argv[1];
-  const auto wss_input_uri =
+  // One or more comma separated WSS URIs.
+  const auto wss_input_uris =
       argc < 3 ? "wss://stream.binance.com:9443/ws/btcusdt@trade/ethusdt@trade"
                : argv[2];
   const auto recv_port_str = argc < 4 ? "60000" : argv[3];
-  opentoken::process_stdin(output_path, wss_input_uri,
+  opentoken::process_stdin(output_path, wss_input_uris,
                            std::stoi(recv_port_str));
 }
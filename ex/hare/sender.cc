@@ -1,37 +1,351 @@
 #include "binance.h"
 #include "binance_wss.h"
 #include "coins.h"
+#include "event_loop.h"
 #include "hasher.h"
 #include "network.h"
+#include "protocol.h"
+#include "spsc_ring.h"
 #include "util.h"
 
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
 namespace opentoken {
 namespace {
 using namespace std;
 
+// How often at most the send thread checks for packets from receivers.
+constexpr uint64_t kReceiverPollNanos = 100000;
+
+// What the event loop thread hands the send thread: a record parsed from
+// WSS for the writer of |shard|, or word to flush every writer.
+struct SendItem {
+  enum class Kind : uint8_t {
+    Trade,
+    DepthUpdate,
+    BookTicker,
+    Ticker,
+    Flush,
+  };
+
+  Kind kind;
+  uint8_t shard;
+  uint64_t rx_nanos;
+  union {
+    BinanceTrade trade;
+    BinanceDepthUpdate depth_update;
+    BinanceBookTicker book_ticker;
+    BinanceTicker ticker;
+  };
+};
+
+void set_record(SendItem* item, const BinanceTrade& trade) {
+  item->kind = SendItem::Kind::Trade;
+  item->trade = trade;
+}
+
+// Copies only the levels that are set.
+void set_record(SendItem* item, const BinanceDepthUpdate& update) {
+  item->kind = SendItem::Kind::DepthUpdate;
+  std::memcpy(&item->depth_update, &update, message_size(update));
+}
+
+void set_record(SendItem* item, const BinanceBookTicker& ticker) {
+  item->kind = SendItem::Kind::BookTicker;
+  item->book_ticker = ticker;
+}
+
+void set_record(SendItem* item, const BinanceTicker& ticker) {
+  item->kind = SendItem::Kind::Ticker;
+  item->ticker = ticker;
+}
+
 void process_wss_stream(const char* wss_input_uri,
                         const char* destination_address_str) {
   using namespace std;
   Hasher hasher{getenv("SECRET_MESSAGE_KEY")};
+  // With HARE_ID_CACHE set, Hasher::hash(id) copies signatures from a
+  // window of that many ids ahead of the last one asked for, computed on a
+  // thread of its own. Nothing sent signs a bare id yet, so it is off by
+  // default.
+  const size_t id_cache_window = getenv_uint("HARE_ID_CACHE", 0);
+  if (id_cache_window) {
+    hasher.enable_id_cache(id_cache_window);
+  }
+
+  // Each shard is a separate stream with its own source port, so all trades
+  // of one market stay in order on one receiver thread.
+  const size_t num_shards = getenv_uint("HARE_SHARDS", 1);
+  CHECK(num_shards > 0 && num_shards <= 256, "bad shard count %zu",
+        num_shards);
+  // A multicast destination serves every receiver that joined the group
+  // with one stream. Retransmits still go only to whoever sent the Nack.
+  const bool multicast =
+      is_multicast(string_to_sockaddr(destination_address_str));
+  const char* multicast_iface = getenv("HARE_MULTICAST_IF");
+  const TradeEncoding max_trade_encoding = getenv_trade_encoding();
+  // Sends the datagrams of a WSS batch together, segmented by the kernel
+  // where UDP GSO is available.
+  const bool batch_sends = getenv_uint("HARE_UDP_GSO", 0);
+  // Following every HARE_PARITY_GROUP_SIZE packets with their parity lets
+  // receivers repair single losses without a round trip. Trade packets
+  // shrink so that parity packets still fit HARE_MAX_PACKET_SIZE.
+  const size_t parity_group_size = getenv_uint("HARE_PARITY_GROUP_SIZE", 0);
+  const size_t max_packet_size =
+      getenv_uint("HARE_MAX_PACKET_SIZE", kDefaultMaxPacketSize) -
+      (parity_group_size ? kParityOverhead : 0);
+  // HARE_SNDBUF sizes each socket's kernel send buffer, which has to hold a
+  // whole burst of batched sends.
+  const size_t send_buffer = getenv_uint("HARE_SNDBUF", 0);
+  vector<unique_ptr<UDPSocket>> sockets;
+  vector<unique_ptr<TradePacketWriter>> writers;
+  for (size_t shard = 0; shard < num_shards; ++shard) {
+    sockets.emplace_back(new UDPSocket{});
+    if (send_buffer) {
+      sockets.back()->set_send_buffer(send_buffer);
+    }
+    if (multicast) {
+      sockets.back()->set_multicast_ttl(
+          static_cast<int>(getenv_uint("HARE_MULTICAST_TTL", 1)));
+      sockets.back()->set_multicast_loop(getenv_uint("HARE_MULTICAST_LOOP", 1));
+      if (multicast_iface && *multicast_iface) {
+        sockets.back()->set_multicast_interface(multicast_iface);
+      }
+    }
+    // HARE_FLUSH_DEADLINE_US bounds how long records wait within one WSS
+    // batch. Every writer is flushed at the end of each batch.
+    writers.emplace_back(new TradePacketWriter{
+        &hasher, sockets.back().get(), destination_address_str,
+        max_packet_size, 1000 * getenv_uint("HARE_FLUSH_DEADLINE_US", 50),
+        getenv_uint("HARE_RETRANSMIT_PACKETS", 4096),
+        static_cast<uint8_t>(shard), max_trade_encoding});
+    writers.back()->set_parity_group_size(parity_group_size);
+    if (batch_sends) {
+      if (!sockets.back()->enable_gso()) {
+        fprintf(stderr, "UDP GSO unavailable, batching with sendmmsg\n");
+      }
+      writers.back()->set_batch_sends(true);
+    }
+  }
+
+  // With HARE_SEND_THREAD set, the event loop thread only reads and parses
+  // WSS frames, and queues what it parsed in a ring of HARE_SEND_RING items
+  // for a send thread, pinned to HARE_SEND_CPU if that is set. The send
+  // thread signs and sends, and answers receivers, so a slow HMAC or sendto
+  // no longer holds up reading the next frame. Pinned to a core of its own
+  // it spins while idle, for the lowest latency; otherwise it sleeps until
+  // there is work.
+  const bool send_thread = getenv_uint("HARE_SEND_THREAD", 0);
+  constexpr uint64_t kNoPinning = ~0ULL;
+  const uint64_t send_cpu = getenv_uint("HARE_SEND_CPU", kNoPinning);
+  const int report_interval_ms =
+      static_cast<int>(1000 * getenv_uint("HARE_REPORT_INTERVAL_S", 60));
+
+  // Packets from receivers are only read at the end of a WSS batch, so
+  // retransmits never delay fresh trades. The loop only says which sockets
+  // have any.
+  EventLoop loop;
+  std::vector<UDPMessage> in_messages(8);
+  vector<bool> readable(num_shards, false);
+  const auto handle_receiver_packets = [&](size_t shard) {
+    size_t num_received;
+    do {
+      num_received = sockets[shard]->receive_many(in_messages.data(),
+                                                  in_messages.size());
+      for (size_t i = 0; i < num_received; ++i) {
+        const auto* header = verify_packet(in_messages[i], &hasher);
+        if (!header) {
+          continue;
+        }
+        if (header->type == PacketType::Nack) {
+          writers[shard]->handle_nack(*header, in_messages[i]);
+        } else if (header->type == PacketType::Hello) {
+          writers[shard]->handle_hello(*header, in_messages[i]);
+        } else if (header->type == PacketType::TimeRequest) {
+          writers[shard]->handle_time_request(*header, in_messages[i]);
+        }
+      }
+    } while (num_received == in_messages.size());
+  };
+  const auto flush_writers = [&writers]() {
+    for (auto& writer : writers) {
+      writer->flush();
+    }
+  };
+  // While the WSS stream is quiet, heartbeats tell receivers that we are up
+  // and how far we got.
+  const auto heartbeat_ms =
+      getenv_uint("HARE_HEARTBEAT_MS", kDefaultHeartbeatMs);
+  const auto send_heartbeats = [&writers]() {
+    for (auto& writer : writers) {
+      writer->heartbeat();
+    }
+  };
+  // Messages too large for a datagram only reach receivers over their own
+  // WSS connections. Call from the thread that signs and sends.
+  const auto report_sending = [&writers, &hasher]() {
+    for (size_t shard = 0; shard < writers.size(); ++shard) {
+      fprintf(stderr, "shard %zu: %llu messages too large for a datagram\n",
+              shard,
+              static_cast<unsigned long long>(
+                  writers[shard]->oversized_messages()));
+    }
+    if (hasher.id_cache()) {
+      hasher.id_cache()->report(stderr);
+    }
+  };
+  if (!send_thread) {
+    for (size_t shard = 0; shard < num_shards; ++shard) {
+      loop.on_readable(sockets[shard]->fd(),
+                       [&readable, shard]() { readable[shard] = true; });
+    }
+  }
 
-  BinanceTradeParser trade_parser;
-  UDPMessage out_message{};
-  out_message.SetSize(sizeof(TradeMessage));
-  out_message.SetAddrFromString(destination_address_str);
-  UDPSocket socket{};
-
-  std::cout << "Sending to " << out_message.addr_str() << "\n";
-
-  BinanceWSSReader wss_reader(wss_input_uri, [&out_message, &socket, &hasher](
-                                                 const BinanceTrade& trade) {
-    auto* as_trade = reinterpret_cast<TradeMessage*>(out_message.data());
-    as_trade->trade = trade;
-    hasher.hash(reinterpret_cast<const uint8_t*>(&as_trade->trade),
-                sizeof(as_trade->trade), as_trade->signature);
-    socket.send_one(out_message);
+  std::cout << "Sending to " << writers[0]->addr_str() << " in " << num_shards
+            << " shards, up to " << writers[0]->max_trades()
+            << " trades per packet\n";
+
+  // Trades, depth updates and tickers of a market share its shard's stream.
+  if (send_thread) {
+    SpscRing<SendItem> ring{getenv_uint("HARE_SEND_RING", 1024)};
+    std::cout << "Signing and sending on a separate thread, queueing up to "
+              << ring.capacity() << " items\n";
+    unique_ptr<RingDoorbell> doorbell;
+    if (send_cpu == kNoPinning) {
+      doorbell.reset(new RingDoorbell);
+      for (const auto& socket : sockets) {
+        doorbell->watch(socket->fd());
+      }
+    }
+    BinanceWSSReader wss_reader(
+        &loop, wss_input_uri,
+        [&ring, &doorbell, &wss_reader, num_shards](const auto& message) {
+          SendItem* item = ring.begin_push();
+          set_record(item, message);
+          item->shard =
+              static_cast<uint8_t>(market_shard(message.market, num_shards));
+          const uint64_t rx_nanos = wss_reader.rx_nanos();
+          item->rx_nanos = rx_nanos ? rx_nanos : nanos_since_epoch();
+          ring.end_push();
+          if (doorbell) {
+            doorbell->ring();
+          }
+        });
+    loop.on_batch_end([&ring, &doorbell]() {
+      ring.begin_push()->kind = SendItem::Kind::Flush;
+      ring.end_push();
+      if (doorbell) {
+        doorbell->ring();
+      }
+    });
+    loop.every(report_interval_ms, [&ring, &wss_reader]() {
+      ring.report(stderr, "send ring");
+      wss_reader.report(stderr, "wss");
+    });
+
+    init_openssl_threading();
+    thread sender([&]() {
+      if (send_cpu != kNoPinning) {
+        pin_thread_to_cpu(send_cpu);
+      }
+      const uint64_t heartbeat_nanos = 1000000 * heartbeat_ms;
+      uint64_t next_heartbeat_nanos = nanos_monotonic() + heartbeat_nanos;
+      uint64_t next_poll_nanos = 0;
+      const uint64_t report_interval_nanos = 1000000ULL * report_interval_ms;
+      uint64_t next_report_nanos = nanos_monotonic() + report_interval_nanos;
+      while (true) {
+        SendItem* item = ring.front();
+        if (item) {
+          switch (item->kind) {
+            case SendItem::Kind::Trade:
+              writers[item->shard]->add(item->trade, item->rx_nanos);
+              break;
+            case SendItem::Kind::DepthUpdate:
+              writers[item->shard]->add(item->depth_update, item->rx_nanos);
+              break;
+            case SendItem::Kind::BookTicker:
+              writers[item->shard]->add(item->book_ticker, item->rx_nanos);
+              break;
+            case SendItem::Kind::Ticker:
+              writers[item->shard]->add(item->ticker, item->rx_nanos);
+              break;
+            case SendItem::Kind::Flush:
+              flush_writers();
+              break;
+          }
+          const bool flushed = item->kind == SendItem::Kind::Flush;
+          ring.pop();
+          if (!flushed) {
+            continue;
+          }
+        }
+
+        // Receivers and heartbeats are seen to between WSS batches.
+        const uint64_t now = nanos_monotonic();
+        if (now >= next_poll_nanos) {
+          for (size_t shard = 0; shard < num_shards; ++shard) {
+            handle_receiver_packets(shard);
+          }
+          next_poll_nanos = now + kReceiverPollNanos;
+        }
+        if (heartbeat_nanos && now >= next_heartbeat_nanos) {
+          send_heartbeats();
+          next_heartbeat_nanos = now + heartbeat_nanos;
+        }
+        if (now >= next_report_nanos) {
+          report_sending();
+          next_report_nanos = now + report_interval_nanos;
+        }
+        if (item) {
+          continue;
+        }
+        if (doorbell) {
+          // Until the next item, a packet from a receiver or heartbeat.
+          const int timeout_ms =
+              heartbeat_nanos
+                  ? static_cast<int>((next_heartbeat_nanos - now + 999999) /
+                                     1000000)
+                  : -1;
+          doorbell->wait(&ring, timeout_ms);
+          next_poll_nanos = 0;
+        } else {
+          cpu_relax();
+        }
+      }
+    });
+    loop.run();
+    sender.join();
+    return;
+  }
+
+  BinanceWSSReader wss_reader(
+      &loop, wss_input_uri,
+      [&writers, &wss_reader, num_shards](const auto& message) {
+        const uint64_t rx_nanos = wss_reader.rx_nanos();
+        writers[market_shard(message.market, num_shards)]->add(
+            message, rx_nanos ? rx_nanos : nanos_since_epoch());
+      });
+  loop.on_batch_end([&]() {
+    flush_writers();
+    for (size_t shard = 0; shard < num_shards; ++shard) {
+      if (readable[shard]) {
+        readable[shard] = false;
+        handle_receiver_packets(shard);
+      }
+    }
+  });
+  if (heartbeat_ms) {
+    loop.every(static_cast<int>(heartbeat_ms), send_heartbeats);
+  }
+  loop.every(report_interval_ms, [&]() {
+    wss_reader.report(stderr, "wss");
+    report_sending();
   });
 
-  wss_reader.run();
+  loop.run();
 }
 
 }  // namespace
@@ -0,0 +1,210 @@
+#ifndef _OPENTOKEN__HARE__SEQUENCE_H_
+#define _OPENTOKEN__HARE__SEQUENCE_H_
+
+#include "check.h"
+#include "network.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace opentoken {
+
+// A run of |count| consecutive sequence numbers starting at |first|.
+struct SequenceRange {
+  uint64_t first;
+  uint64_t count;
+};
+
+// Keeps copies of the last |capacity| signed datagrams so they can be resent
+// byte for byte when a receiver reports them missing.
+class RetransmitRing final {
+ public:
+  RetransmitRing(size_t capacity, size_t max_packet_size)
+      : capacity_(capacity),
+        max_packet_size_(max_packet_size),
+        data_(capacity * max_packet_size),
+        slots_(capacity) {
+    CHECK(capacity > 0);
+  }
+
+  void store(uint64_t sequence, const uint8_t* data, size_t size) {
+    CHECK(size <= max_packet_size_, "%zu byte packet", size);
+    const size_t index = sequence % capacity_;
+    std::memcpy(&data_[index * max_packet_size_], data, size);
+    slots_[index] = Slot{sequence, size};
+  }
+
+  // Copies packet |sequence| into |message|. Returns false when it has
+  // already been overwritten or was never sent.
+  bool load(uint64_t sequence, UDPMessage* message) const {
+    const iovec packet = find(sequence);
+    if (!packet.iov_base) {
+      return false;
+    }
+    std::memcpy(message->data(), packet.iov_base, packet.iov_len);
+    message->SetSize(packet.iov_len);
+    return true;
+  }
+
+  // The stored copy of packet |sequence|, or a null iovec when it has
+  // already been overwritten or was never sent.
+  iovec find(uint64_t sequence) const {
+    const size_t index = sequence % capacity_;
+    const Slot& slot = slots_[index];
+    if (slot.size == 0 || slot.sequence != sequence) {
+      return iovec{nullptr, 0};
+    }
+    return iovec{const_cast<uint8_t*>(&data_[index * max_packet_size_]),
+                 slot.size};
+  }
+
+  size_t capacity() const { return capacity_; }
+
+ private:
+  RetransmitRing(RetransmitRing&) = delete;
+  RetransmitRing(RetransmitRing&&) = delete;
+
+  struct Slot {
+    uint64_t sequence = 0;
+    size_t size = 0;
+  };
+
+  const size_t capacity_;
+  const size_t max_packet_size_;
+  std::vector<uint8_t> data_;
+  std::vector<Slot> slots_;
+};
+
+enum class SequenceStatus {
+  InOrder,
+  Recovered,
+  Duplicate,
+};
+
+// Tracks the sequence numbers seen from one sender. Packets that skip ahead
+// open a gap, which the caller reports back to the sender. Missing packets
+// that arrive later (retransmits or reordering) are accepted once; anything
+// else behind the head is a duplicate. A missing packet that falls more than
+// |window| packets behind the head is counted as lost.
+class SequenceTracker final {
+ public:
+  explicit SequenceTracker(size_t window = 4096) : missing_(window) {
+    CHECK(window > 0);
+  }
+
+  // Records packet |sequence| of |session|. When it reveals newly missing
+  // packets, |gap| is set to them, otherwise gap->count is 0.
+  SequenceStatus on_packet(uint64_t session, uint64_t sequence,
+                           SequenceRange* gap) {
+    *gap = {};
+    if (session != session_) {
+      if (session_ != 0) {
+        fprintf(stderr, "sender restarted, session %llu -> %llu\n",
+                static_cast<unsigned long long>(session_),
+                static_cast<unsigned long long>(session));
+        lost_ += num_missing_;
+      }
+      session_ = session;
+      std::fill(missing_.begin(), missing_.end(), false);
+      num_missing_ = 0;
+      next_ = sequence;
+    }
+
+    if (sequence < next_) {
+      if (next_ - sequence <= missing_.size() && is_missing(sequence)) {
+        set_missing(sequence, false);
+        ++recovered_;
+        return SequenceStatus::Recovered;
+      }
+      ++duplicates_;
+      return SequenceStatus::Duplicate;
+    }
+
+    skip_to(sequence, gap);
+    advance(false);
+    return SequenceStatus::InOrder;
+  }
+
+  // Returns true if packet |sequence| of |session| would be a duplicate,
+  // without recording it.
+  bool is_duplicate(uint64_t session, uint64_t sequence) const {
+    return session == session_ && sequence < next_ &&
+           !(next_ - sequence <= missing_.size() && is_missing(sequence));
+  }
+
+  // Records that |session| has sent every packet up to |last_sequence|, as
+  // a heartbeat says, so that the tail of a burst is not lost silently.
+  // When packets not seen yet are newly missing, |gap| is set to them.
+  void on_heartbeat(uint64_t session, uint64_t last_sequence,
+                    SequenceRange* gap) {
+    *gap = {};
+    if (session == session_ && last_sequence >= next_) {
+      skip_to(last_sequence + 1, gap);
+    }
+  }
+
+  uint64_t gaps() const { return gaps_; }
+  uint64_t recovered() const { return recovered_; }
+  uint64_t lost() const { return lost_; }
+  uint64_t duplicates() const { return duplicates_; }
+
+ private:
+  size_t index(uint64_t sequence) const { return sequence % missing_.size(); }
+  bool is_missing(uint64_t sequence) const {
+    return missing_[index(sequence)];
+  }
+
+  void set_missing(uint64_t sequence, bool missing) {
+    const size_t i = index(sequence);
+    if (missing_[i] != missing) {
+      missing_[i] = missing;
+      num_missing_ = missing ? num_missing_ + 1 : num_missing_ - 1;
+    }
+  }
+
+  // Marks everything from |next_| up to |sequence| missing.
+  void skip_to(uint64_t sequence, SequenceRange* gap) {
+    if (sequence > next_) {
+      *gap = SequenceRange{next_, sequence - next_};
+      gaps_ += gap->count;
+    }
+    if (sequence - next_ > missing_.size()) {
+      // Everything currently missing and all but the last window of the new
+      // gap can no longer be recovered.
+      lost_ += num_missing_ + (sequence - next_ - missing_.size());
+      std::fill(missing_.begin(), missing_.end(), false);
+      num_missing_ = 0;
+      next_ = sequence - missing_.size();
+    }
+    while (next_ < sequence) {
+      advance(true);
+    }
+  }
+
+  // Moves the head past |next_|, evicting whatever was missing one window
+  // behind it.
+  void advance(bool missing) {
+    if (is_missing(next_)) {
+      ++lost_;
+    }
+    set_missing(next_, missing);
+    ++next_;
+  }
+
+  std::vector<bool> missing_;
+  size_t num_missing_ = 0;
+  uint64_t session_ = 0;
+  uint64_t next_ = 0;
+
+  uint64_t gaps_ = 0;
+  uint64_t recovered_ = 0;
+  uint64_t lost_ = 0;
+  uint64_t duplicates_ = 0;
+};
+
+}  // namespace opentoken
+
+#endif  // _OPENTOKEN__HARE__SEQUENCE_H_
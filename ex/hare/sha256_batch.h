@@ -0,0 +1,451 @@
+#ifndef _OPENTOKEN__HARE__SHA256_BATCH_H_
+#define _OPENTOKEN__HARE__SHA256_BATCH_H_
+
+#include "check.h"
+#include "mac.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace opentoken {
+
+// HMAC-SHA256 (RFC 2104) of several messages at once. The inner and outer
+// key blocks are compressed once up front. Which SHA-256 runs is picked at
+// startup: the SHA extensions where the CPU has them, one message at a
+// time, as they beat eight AVX2 lanes; failing that AVX2 with up to eight
+// messages side by side, one per 32 bit lane, the lanes of messages with
+// fewer blocks idling until the longest is done; and otherwise portable
+// code, one message at a time.
+class HmacSha256Batch final {
+ public:
+  constexpr static size_t kTagSize = 32;
+  constexpr static size_t kLanes = 8;
+
+  enum class Impl { Portable, Avx2, ShaNi };
+
+  HmacSha256Batch(const uint8_t* key, size_t key_size,
+                  Impl impl = best_impl())
+      : impl_(impl) {
+    uint8_t block[kBlockSize] = {};
+    if (key_size > kBlockSize) {
+      uint32_t state[8];
+      std::memcpy(state, kIV, sizeof(state));
+      hash(state, 0, key, key_size, block);
+    } else {
+      std::memcpy(block, key, key_size);
+    }
+    for (auto& byte : block) {
+      byte ^= 0x36;
+    }
+    std::memcpy(inner_, kIV, sizeof(inner_));
+    compress(inner_, block);
+    for (auto& byte : block) {
+      byte ^= 0x36 ^ 0x5c;
+    }
+    std::memcpy(outer_, kIV, sizeof(outer_));
+    compress(outer_, block);
+  }
+
+  // The fastest implementation this CPU runs.
+  static Impl best_impl() {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+      return Impl::ShaNi;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      return Impl::Avx2;
+    }
+#endif
+    return Impl::Portable;
+  }
+
+  static const char* impl_name(Impl impl) {
+    switch (impl) {
+      case Impl::Portable:
+        return "portable";
+      case Impl::Avx2:
+        return "avx2";
+      case Impl::ShaNi:
+        return "sha-ni";
+    }
+    return "unknown";
+  }
+
+  Impl impl() const { return impl_; }
+
+  void mac(const uint8_t* input, size_t size, uint8_t tag[kTagSize]) const {
+    uint32_t state[8];
+    std::memcpy(state, inner_, sizeof(state));
+    uint8_t digest[kTagSize];
+    hash(state, kBlockSize, input, size, digest);
+    std::memcpy(state, outer_, sizeof(state));
+    hash(state, kBlockSize, digest, sizeof(digest), tag);
+  }
+
+  // Writes the tag of the |sizes[i]| bytes at |inputs[i]| to |tags[i]| for
+  // each i below |count|.
+  void mac_batch(const uint8_t* const* inputs, const size_t* sizes,
+                 size_t count, uint8_t* const* tags) const {
+    size_t i = 0;
+#if defined(__x86_64__)
+    if (impl_ == Impl::Avx2) {
+      while (count - i > 1) {
+        const size_t lanes = std::min(kLanes, count - i);
+        mac_x8(inputs + i, sizes + i, lanes, tags + i);
+        i += lanes;
+      }
+    }
+#endif
+    for (; i < count; ++i) {
+      mac(inputs[i], sizes[i], tags[i]);
+    }
+  }
+
+ private:
+  constexpr static size_t kBlockSize = 64;
+  // Padding takes at least 9 bytes, so the last part of a message can
+  // spill into a second block.
+  constexpr static size_t kMaxTailBlocks = 2;
+  constexpr static uint32_t kIV[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                      0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                      0x1f83d9ab, 0x5be0cd19};
+  constexpr static uint32_t kK[64] = {
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+      0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+      0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+      0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+      0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+      0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+      0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+      0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+      0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+  static uint32_t load_be32(const uint8_t* p) {
+    uint32_t x;
+    std::memcpy(&x, p, sizeof(x));
+    return __builtin_bswap32(x);
+  }
+
+  static void store_be32(uint8_t* p, uint32_t x) {
+    x = __builtin_bswap32(x);
+    std::memcpy(p, &x, sizeof(x));
+  }
+
+  // Copies the part of a message after its last whole block to |tail| and
+  // pads it, for a hash of |total| bytes in all. Returns the blocks used.
+  static size_t pad_tail(const uint8_t* input, size_t size, uint64_t total,
+                         uint8_t tail[kMaxTailBlocks * kBlockSize]) {
+    const size_t rest = size % kBlockSize;
+    const size_t blocks = rest + 9 > kBlockSize ? 2 : 1;
+    std::memset(tail, 0, blocks * kBlockSize);
+    std::memcpy(tail, input + size - rest, rest);
+    tail[rest] = 0x80;
+    const uint64_t bits = __builtin_bswap64(total * 8);
+    std::memcpy(tail + blocks * kBlockSize - sizeof(bits), &bits,
+                sizeof(bits));
+    return blocks;
+  }
+
+  static void compress(uint32_t* h, const uint8_t* block) {
+    uint32_t w[64];
+    for (size_t t = 0; t < 16; ++t) {
+      w[t] = load_be32(block + 4 * t);
+    }
+    for (size_t t = 16; t < 64; ++t) {
+      const uint32_t s0 =
+          rotr32(w[t - 15], 7) ^ rotr32(w[t - 15], 18) ^ (w[t - 15] >> 3);
+      const uint32_t s1 =
+          rotr32(w[t - 2], 17) ^ rotr32(w[t - 2], 19) ^ (w[t - 2] >> 10);
+      w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+    uint32_t e = h[4], f = h[5], g = h[6], k = h[7];
+    for (size_t t = 0; t < 64; ++t) {
+      const uint32_t t1 = k + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) +
+                          ((e & f) ^ (~e & g)) + kK[t] + w[t];
+      const uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) +
+                          ((a & b) ^ (a & c) ^ (b & c));
+      k = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+  }
+
+  void compress_blocks(uint32_t* state, const uint8_t* blocks,
+                       size_t count) const {
+#if defined(__x86_64__)
+    if (impl_ == Impl::ShaNi) {
+      compress_sha_ni(state, blocks, count);
+      return;
+    }
+#endif
+    for (size_t i = 0; i < count; ++i) {
+      compress(state, blocks + i * kBlockSize);
+    }
+  }
+
+  // Finishes hashing |input| from |state|, which has |prefix| bytes hashed
+  // already, and writes the digest to |output|.
+  void hash(uint32_t* state, uint64_t prefix, const uint8_t* input,
+            size_t size, uint8_t output[kTagSize]) const {
+    compress_blocks(state, input, size / kBlockSize);
+    uint8_t tail[kMaxTailBlocks * kBlockSize];
+    const size_t blocks = pad_tail(input, size, prefix + size, tail);
+    compress_blocks(state, tail, blocks);
+    for (size_t i = 0; i < 8; ++i) {
+      store_be32(output + 4 * i, state[i]);
+    }
+  }
+
+#if defined(__x86_64__)
+  // compress() of |count| consecutive blocks with the SHA extensions, four
+  // rounds per group of |msg|, after Intel's reference code.
+  __attribute__((target("sha,sse4.1"))) static void compress_sha_ni(
+      uint32_t* h, const uint8_t* blocks, size_t count) {
+    const __m128i swap =
+        _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    // The instructions want the state as ABEF and CDGH.
+    __m128i cdab = _mm_shuffle_epi32(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(h)), 0xb1);
+    __m128i efgh = _mm_shuffle_epi32(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(h + 4)), 0x1b);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xf0);
+
+    for (; count > 0; --count, blocks += kBlockSize) {
+      const __m128i abef_before = abef;
+      const __m128i cdgh_before = cdgh;
+      __m128i msg[4];
+#pragma GCC unroll 16
+      for (size_t i = 0; i < 16; ++i) {
+        __m128i& current = msg[i % 4];
+        if (i < 4) {
+          current = _mm_shuffle_epi8(
+              _mm_loadu_si128(
+                  reinterpret_cast<const __m128i*>(blocks + 16 * i)),
+              swap);
+        }
+        __m128i rounds = _mm_add_epi32(
+            current,
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(kK + 4 * i)));
+        cdgh = _mm_sha256rnds2_epu32(cdgh, abef, rounds);
+        if (i >= 3 && i < 15) {
+          __m128i& next = msg[(i + 1) % 4];
+          next = _mm_add_epi32(
+              next, _mm_alignr_epi8(current, msg[(i + 3) % 4], 4));
+          next = _mm_sha256msg2_epu32(next, current);
+        }
+        rounds = _mm_shuffle_epi32(rounds, 0x0e);
+        abef = _mm_sha256rnds2_epu32(abef, cdgh, rounds);
+        if (i >= 1 && i < 13) {
+          __m128i& previous = msg[(i + 3) % 4];
+          previous = _mm_sha256msg1_epu32(previous, current);
+        }
+      }
+      abef = _mm_add_epi32(abef, abef_before);
+      cdgh = _mm_add_epi32(cdgh, cdgh_before);
+    }
+
+    const __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+    const __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(h),
+                     _mm_blend_epi16(feba, dchg, 0xf0));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(h + 4),
+                     _mm_alignr_epi8(dchg, feba, 8));
+  }
+
+  __attribute__((target("avx2"))) static __m256i rotr_x8(__m256i x,
+                                                         int bits) {
+    return _mm256_or_si256(_mm256_srli_epi32(x, bits),
+                           _mm256_slli_epi32(x, 32 - bits));
+  }
+
+  // Compresses |blocks[lane]| into column |lane| of |state|, which holds
+  // word i of every lane in row i, for the lanes set in |active|.
+  __attribute__((target("avx2"))) static void compress_x8(
+      uint32_t state[8][kLanes], const uint8_t* const blocks[kLanes],
+      uint32_t active) {
+    const __m256i swap = _mm256_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7,
+        6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i w[16];
+    // Transposes each half block of the eight lanes into eight words of
+    // the schedule.
+    for (size_t half = 0; half < 2; ++half) {
+      __m256i r[kLanes];
+      for (size_t lane = 0; lane < kLanes; ++lane) {
+        r[lane] = _mm256_shuffle_epi8(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(
+                blocks[lane] + half * kBlockSize / 2)),
+            swap);
+      }
+      __m256i t[kLanes];
+      for (size_t i = 0; i < kLanes; i += 2) {
+        t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+      }
+      __m256i u[kLanes];
+      for (size_t i = 0; i < kLanes; i += 4) {
+        u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+      }
+      __m256i* out = w + half * 8;
+      for (size_t i = 0; i < 4; ++i) {
+        out[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+        out[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+      }
+    }
+
+    __m256i v[8];
+    for (size_t i = 0; i < 8; ++i) {
+      v[i] = _mm256_load_si256(reinterpret_cast<const __m256i*>(state[i]));
+    }
+    __m256i a = v[0], b = v[1], c = v[2], d = v[3];
+    __m256i e = v[4], f = v[5], g = v[6], k = v[7];
+#pragma GCC unroll 64
+    for (size_t t = 0; t < 64; ++t) {
+      __m256i& wt = w[t % 16];
+      if (t >= 16) {
+        const __m256i w15 = w[(t - 15) % 16];
+        const __m256i w2 = w[(t - 2) % 16];
+        const __m256i s0 = _mm256_xor_si256(
+            _mm256_xor_si256(rotr_x8(w15, 7), rotr_x8(w15, 18)),
+            _mm256_srli_epi32(w15, 3));
+        const __m256i s1 = _mm256_xor_si256(
+            _mm256_xor_si256(rotr_x8(w2, 17), rotr_x8(w2, 19)),
+            _mm256_srli_epi32(w2, 10));
+        wt = _mm256_add_epi32(_mm256_add_epi32(wt, s0),
+                              _mm256_add_epi32(w[(t - 7) % 16], s1));
+      }
+      const __m256i sum1 = _mm256_xor_si256(
+          _mm256_xor_si256(rotr_x8(e, 6), rotr_x8(e, 11)), rotr_x8(e, 25));
+      const __m256i ch =
+          _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+      const __m256i t1 = _mm256_add_epi32(
+          _mm256_add_epi32(_mm256_add_epi32(k, sum1), ch),
+          _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(kK[t])), wt));
+      const __m256i sum0 = _mm256_xor_si256(
+          _mm256_xor_si256(rotr_x8(a, 2), rotr_x8(a, 13)), rotr_x8(a, 22));
+      const __m256i maj = _mm256_xor_si256(
+          _mm256_and_si256(a, b),
+          _mm256_and_si256(c, _mm256_xor_si256(a, b)));
+      const __m256i t2 = _mm256_add_epi32(sum0, maj);
+      k = g;
+      g = f;
+      f = e;
+      e = _mm256_add_epi32(d, t1);
+      d = c;
+      c = b;
+      b = a;
+      a = _mm256_add_epi32(t1, t2);
+    }
+
+    const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    const __m256i mask = _mm256_cmpeq_epi32(
+        _mm256_and_si256(_mm256_set1_epi32(static_cast<int>(active)), bits),
+        bits);
+    const __m256i rounds[8] = {a, b, c, d, e, f, g, k};
+    for (size_t i = 0; i < 8; ++i) {
+      _mm256_store_si256(
+          reinterpret_cast<__m256i*>(state[i]),
+          _mm256_blendv_epi8(v[i], _mm256_add_epi32(v[i], rounds[i]), mask));
+    }
+  }
+
+  // mac_batch() of 2 to 8 messages.
+  __attribute__((target("avx2"))) void mac_x8(const uint8_t* const* inputs,
+                                              const size_t* sizes,
+                                              size_t lanes,
+                                              uint8_t* const* tags) const {
+    alignas(32) uint32_t state[8][kLanes];
+    uint8_t tails[kLanes][kMaxTailBlocks * kBlockSize];
+    size_t full[kLanes] = {};
+    size_t blocks[kLanes] = {};
+    size_t max_blocks = 0;
+    for (size_t lane = 0; lane < lanes; ++lane) {
+      full[lane] = sizes[lane] / kBlockSize;
+      blocks[lane] = full[lane] + pad_tail(inputs[lane], sizes[lane],
+                                           kBlockSize + sizes[lane],
+                                           tails[lane]);
+      max_blocks = std::max(max_blocks, blocks[lane]);
+    }
+    for (size_t i = 0; i < 8; ++i) {
+      for (size_t lane = 0; lane < kLanes; ++lane) {
+        state[i][lane] = inner_[i];
+      }
+    }
+
+    // Idle lanes hash this, and keep their state.
+    static const uint8_t kIdleBlock[kBlockSize] = {};
+    const uint8_t* block_ptrs[kLanes];
+    for (size_t step = 0; step < max_blocks; ++step) {
+      uint32_t active = 0;
+      for (size_t lane = 0; lane < kLanes; ++lane) {
+        if (step < full[lane]) {
+          block_ptrs[lane] = inputs[lane] + step * kBlockSize;
+        } else if (step < blocks[lane]) {
+          block_ptrs[lane] = tails[lane] + (step - full[lane]) * kBlockSize;
+        } else {
+          block_ptrs[lane] = kIdleBlock;
+          continue;
+        }
+        active |= 1u << lane;
+      }
+      compress_x8(state, block_ptrs, active);
+    }
+
+    // The outer hash is of the 32 byte inner digest, one block each.
+    uint8_t outer_blocks[kLanes][kBlockSize];
+    for (size_t lane = 0; lane < kLanes; ++lane) {
+      uint8_t* block = outer_blocks[lane];
+      uint8_t digest[kTagSize];
+      for (size_t i = 0; i < 8; ++i) {
+        store_be32(digest + 4 * i, state[i][lane]);
+      }
+      pad_tail(digest, kTagSize, kBlockSize + kTagSize, block);
+      block_ptrs[lane] = block;
+    }
+    for (size_t i = 0; i < 8; ++i) {
+      for (size_t lane = 0; lane < kLanes; ++lane) {
+        state[i][lane] = outer_[i];
+      }
+    }
+    compress_x8(state, block_ptrs, (1u << lanes) - 1);
+    for (size_t lane = 0; lane < lanes; ++lane) {
+      for (size_t i = 0; i < 8; ++i) {
+        store_be32(tags[lane] + 4 * i, state[i][lane]);
+      }
+    }
+  }
+#endif
+
+  const Impl impl_;
+  uint32_t inner_[8];
+  uint32_t outer_[8];
+};
+
+}  // namespace opentoken
+
+#endif  // _OPENTOKEN__HARE__SHA256_BATCH_H_
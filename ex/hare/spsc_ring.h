@@ -0,0 +1,180 @@
+#ifndef _OPENTOKEN__HARE__SPSC_RING_H_
+#define _OPENTOKEN__HARE__SPSC_RING_H_
+
+#include "check.h"
+#include "network.h"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace opentoken {
+
+// A fixed size queue from one producer thread to one consumer thread. Items
+// are written and read in place: the producer fills the slot from
+// begin_push() and publishes it with end_push(), the consumer reads front()
+// and frees it with pop(). Neither side locks or makes a system call.
+//
+// The producer also keeps statistics on how deep the queue was when it
+// pushed, for report(), which must be called on the producer thread.
+template <typename T>
+class SpscRing final {
+ public:
+  explicit SpscRing(size_t capacity) {
+    CHECK(capacity > 0, "empty ring");
+    capacity_ = 1;
+    while (capacity_ < capacity) {
+      capacity_ *= 2;
+    }
+    mask_ = capacity_ - 1;
+    slots_.reset(new T[capacity_]);
+  }
+
+  size_t capacity() const { return capacity_; }
+
+  // Producer: returns the next free slot, waiting for the consumer while
+  // the ring is full.
+  T* begin_push() {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ == capacity_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ == capacity_) {
+        ++full_;
+        do {
+          std::this_thread::yield();
+          cached_head_ = head_.load(std::memory_order_acquire);
+        } while (tail - cached_head_ == capacity_);
+      }
+    }
+    return &slots_[tail & mask_];
+  }
+
+  // Producer: hands the slot from begin_push() to the consumer.
+  void end_push() {
+    const size_t tail = tail_.load(std::memory_order_relaxed) + 1;
+    tail_.store(tail, std::memory_order_release);
+    cached_head_ = head_.load(std::memory_order_acquire);
+    const size_t depth = tail - cached_head_;
+    ++pushes_;
+    depth_sum_ += depth;
+    max_depth_ = std::max(max_depth_, depth);
+  }
+
+  // Consumer: returns the oldest item, or nullptr if there is none.
+  T* front() {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_) {
+        return nullptr;
+      }
+    }
+    return &slots_[head & mask_];
+  }
+
+  // Consumer: frees the item from front().
+  void pop() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+  // Producer: writes the queue depth seen on each push and how often the
+  // ring was full since the last report.
+  void report(FILE* f, const char* name) {
+    fprintf(f,
+            "%s: %llu pushed, mean depth %.1f, max depth %zu of %zu, full "
+            "%llu times\n",
+            name, static_cast<unsigned long long>(pushes_),
+            pushes_ ? static_cast<double>(depth_sum_) /
+                          static_cast<double>(pushes_)
+                    : 0.0,
+            max_depth_, capacity_, static_cast<unsigned long long>(full_));
+    pushes_ = 0;
+    depth_sum_ = 0;
+    max_depth_ = 0;
+    full_ = 0;
+  }
+
+ private:
+  SpscRing(SpscRing&) = delete;
+  SpscRing(SpscRing&&) = delete;
+
+  size_t capacity_;
+  size_t mask_;
+  std::unique_ptr<T[]> slots_;
+
+  // Written by the consumer.
+  alignas(kCacheLineSize) std::atomic<size_t> head_{0};
+  size_t cached_tail_ = 0;
+
+  // Written by the producer.
+  alignas(kCacheLineSize) std::atomic<size_t> tail_{0};
+  size_t cached_head_ = 0;
+  uint64_t pushes_ = 0;
+  uint64_t depth_sum_ = 0;
+  size_t max_depth_ = 0;
+  uint64_t full_ = 0;
+};
+
+// Lets the consumer of an SpscRing sleep while the ring is empty, for a
+// thread without a core of its own to spin on. The producer calls ring()
+// after each end_push(), which only makes a system call while the consumer
+// sleeps.
+class RingDoorbell final {
+ public:
+  RingDoorbell() : event_fd_(eventfd(0, EFD_NONBLOCK)) {
+    CHECK_ERRNO(event_fd_ >= 0);
+    pollfds_.push_back(pollfd{event_fd_, POLLIN, 0});
+  }
+
+  ~RingDoorbell() { close(event_fd_); }
+
+  // Consumer: also wakes up for data to read on |fd|.
+  void watch(int fd) { pollfds_.push_back(pollfd{fd, POLLIN, 0}); }
+
+  // Producer: wakes the consumer if it sleeps in wait().
+  void ring() {
+    // Orders the push before the check, as wait() orders the other way.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_relaxed) &&
+        sleeping_.exchange(false, std::memory_order_relaxed)) {
+      const uint64_t one = 1;
+      CHECK_ERRNO(write(event_fd_, &one, sizeof(one)) == sizeof(one));
+    }
+  }
+
+  // Consumer: unless |ring| has an item already, sleeps until ring(), a
+  // watched fd is readable or |timeout_ms| passed, or for good if that is
+  // negative.
+  template <typename T>
+  void wait(SpscRing<T>* ring, int timeout_ms) {
+    sleeping_.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!ring->front()) {
+      CHECK_ERRNO(poll(pollfds_.data(), pollfds_.size(), timeout_ms) >= 0 ||
+                  errno == EINTR);
+    }
+    sleeping_.store(false, std::memory_order_relaxed);
+    uint64_t count;
+    (void)!read(event_fd_, &count, sizeof(count));
+  }
+
+ private:
+  RingDoorbell(RingDoorbell&) = delete;
+  RingDoorbell(RingDoorbell&&) = delete;
+
+  const int event_fd_;
+  std::vector<pollfd> pollfds_;
+  std::atomic<bool> sleeping_{false};
+};
+
+}  // namespace opentoken
+
+#endif  // _OPENTOKEN__HARE__SPSC_RING_H_
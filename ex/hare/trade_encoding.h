@@ -0,0 +1,260 @@
+#ifndef _OPENTOKEN__HARE__TRADE_ENCODING_H_
+#define _OPENTOKEN__HARE__TRADE_ENCODING_H_
+
+#include "binance.h"
+#include "check.h"
+#include "coins.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace opentoken {
+
+// How trades are laid out in a datagram. Receivers offer the newest one they
+// understand and senders use the oldest offered, so only append.
+enum class TradeEncoding : uint8_t {
+  Raw = 0,      // BinanceTrade structs as they are in memory
+  Compact = 1,  // see CompactTradeCodec
+};
+constexpr TradeEncoding kNewestTradeEncoding = TradeEncoding::Compact;
+
+// Bytes one trade takes at most in the compact encoding: flags, symbol id 0,
+// name, and four varints of up to 10 bytes.
+constexpr size_t kMaxCompactTradeSize =
+    1 + 1 + sizeof(BinanceTrade::market) + 4 * 10;
+
+constexpr uint8_t kMaxDecimals = 8;
+constexpr double kPowersOf10[kMaxDecimals + 1] = {1e0, 1e1, 1e2, 1e3, 1e4,
+                                                  1e5, 1e6, 1e7, 1e8};
+
+inline size_t put_varint(uint64_t value, uint8_t* out) {
+  size_t size = 0;
+  while (value >= 0x80) {
+    out[size++] = static_cast<uint8_t>(value | 0x80);
+    value >>= 7;
+  }
+  out[size++] = static_cast<uint8_t>(value);
+  return size;
+}
+
+inline bool get_varint(const uint8_t** in, const uint8_t* end, uint64_t* value) {
+  *value = 0;
+  for (unsigned shift = 0; shift < 64 && *in < end; shift += 7) {
+    const uint8_t byte = *(*in)++;
+    *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The newest encoding to agree on, from HARE_TRADE_ENCODING. 0 keeps trades
+// raw.
+inline TradeEncoding getenv_trade_encoding() {
+  const auto value = getenv_uint("HARE_TRADE_ENCODING",
+                                 static_cast<uint64_t>(kNewestTradeEncoding));
+  CHECK(value <= static_cast<uint64_t>(kNewestTradeEncoding),
+        "unknown trade encoding %llu", static_cast<unsigned long long>(value));
+  return static_cast<TradeEncoding>(value);
+}
+
+// Maps small negative deltas to small varints.
+inline uint64_t zigzag(uint64_t delta) {
+  return delta << 1 ^ (0 - (delta >> 63));
+}
+inline uint64_t unzigzag(uint64_t value) {
+  return value >> 1 ^ (0 - (value & 1));
+}
+
+// Fingerprints the first |num_symbols| entries of kSymbols, for peers to
+// check that they number markets alike.
+inline uint32_t symbols_digest(uint32_t num_symbols) {
+  uint32_t hash = 2166136261u;
+  const auto mix = [&hash](uint8_t byte) { hash = (hash ^ byte) * 16777619u; };
+  for (uint32_t i = 0; i < num_symbols && i < kNumSymbols; ++i) {
+    for (const char* c = kSymbols[i].market; *c; ++c) {
+      mix(static_cast<uint8_t>(*c));
+    }
+    mix(0);
+    mix(kSymbols[i].price_decimals);
+    mix(kSymbols[i].quantity_decimals);
+  }
+  return hash;
+}
+
+// Encodes trades into a datagram one after another, each as
+//   flags              byte, how price and quantity are encoded
+//   symbol             varint index in kSymbols, or 0, a length byte and the
+//                      name for markets not listed in the first
+//                      num_symbols() entries, which every receiver knows
+//   price, quantity    each an unsigned varint in steps of the symbol's
+//                      decimals, a varint in steps of 1e-8 if that is not
+//                      exact, or else the raw double
+//   trade_id           zigzag varint delta from the previous trade of the
+//                      same symbol in the datagram
+//   trade_time         zigzag varint delta from the previous trade
+// Binance quotes every price and quantity with at most 8 decimals, so the
+// raw doubles are for other feeds. Call reset() at the start of every
+// datagram so that each one decodes on its own. The trades in a datagram
+// may be followed by zero padding.
+class CompactTradeCodec final {
+ public:
+  CompactTradeCodec() { reset(); }
+
+  void reset() {
+    std::memset(last_trade_ids_, 0, sizeof(last_trade_ids_));
+    last_trade_time_ = 0;
+  }
+
+  // Limits the markets encoded by id to the first |num_symbols| in
+  // kSymbols, the most that the receivers know.
+  void set_num_symbols(uint32_t num_symbols) {
+    num_symbols_ = std::min(num_symbols, kNumSymbols);
+  }
+  uint32_t num_symbols() const { return num_symbols_; }
+
+  // Writes |trade| to |out|, which must have room for kMaxCompactTradeSize
+  // bytes. Returns the bytes written.
+  size_t encode(const BinanceTrade& trade, uint8_t* out) {
+    uint32_t symbol = 1;
+    while (symbol < num_symbols_ &&
+           std::strcmp(kSymbols[symbol].market, trade.market) != 0) {
+      ++symbol;
+    }
+    if (symbol >= num_symbols_) {
+      symbol = 0;
+    }
+    const SymbolInfo& info = kSymbols[symbol];
+
+    uint8_t* const flags = out++;
+    out += put_varint(symbol, out);
+    if (symbol == 0) {
+      const size_t length = strnlen(trade.market, sizeof(trade.market) - 1);
+      *out++ = static_cast<uint8_t>(length);
+      std::memcpy(out, trade.market, length);
+      out += length;
+    }
+    const uint8_t price_mode =
+        put_number(trade.price, info.price_decimals, &out);
+    const uint8_t quantity_mode =
+        put_number(trade.quantity, info.quantity_decimals, &out);
+    *flags = static_cast<uint8_t>(price_mode | quantity_mode << 2);
+
+    out += put_varint(zigzag(trade.trade_id - last_trade_ids_[symbol]), out);
+    out += put_varint(zigzag(trade.trade_time - last_trade_time_), out);
+    last_trade_ids_[symbol] = trade.trade_id;
+    last_trade_time_ = trade.trade_time;
+    return static_cast<size_t>(out - flags);
+  }
+
+  // Reads the trade at |*in|, which must end before |end|, and moves |*in|
+  // past it. Returns false if the data is malformed.
+  bool decode(const uint8_t** in, const uint8_t* end, BinanceTrade* trade) {
+    *trade = BinanceTrade{};
+    if (*in == end) {
+      return false;
+    }
+    const uint8_t flags = *(*in)++;
+    uint64_t symbol;
+    if (!get_varint(in, end, &symbol) || symbol >= kNumSymbols) {
+      return false;
+    }
+    if (symbol == 0) {
+      if (*in == end) {
+        return false;
+      }
+      const size_t length = *(*in)++;
+      if (length >= sizeof(trade->market) ||
+          static_cast<size_t>(end - *in) < length) {
+        return false;
+      }
+      std::memcpy(trade->market, *in, length);
+      *in += length;
+    } else {
+      std::strcpy(trade->market, kSymbols[symbol].market);
+    }
+    const SymbolInfo& info = kSymbols[symbol];
+
+    uint64_t trade_id_delta, trade_time_delta;
+    if (!get_number(flags & 3, info.price_decimals, in, end, &trade->price) ||
+        !get_number(flags >> 2 & 3, info.quantity_decimals, in, end,
+                    &trade->quantity) ||
+        !get_varint(in, end, &trade_id_delta) ||
+        !get_varint(in, end, &trade_time_delta)) {
+      return false;
+    }
+    trade->trade_id = last_trade_ids_[symbol] + unzigzag(trade_id_delta);
+    trade->trade_time = last_trade_time_ + unzigzag(trade_time_delta);
+    last_trade_ids_[symbol] = trade->trade_id;
+    last_trade_time_ = trade->trade_time;
+    return true;
+  }
+
+ private:
+  CompactTradeCodec(CompactTradeCodec&) = delete;
+  CompactTradeCodec(CompactTradeCodec&&) = delete;
+
+  enum NumberMode : uint8_t {
+    kSymbolDecimals = 0,
+    kMaxDecimalsMode = 1,
+    kDouble = 2,
+  };
+
+  // Sets |mantissa| to |value| in steps of 10^-|decimals| if that decodes
+  // back to exactly |value|.
+  static bool to_fixed(double value, uint8_t decimals, uint64_t* mantissa) {
+    const double scaled = value * kPowersOf10[decimals];
+    if (!(scaled >= 0 && scaled < 9e18)) {
+      return false;
+    }
+    *mantissa = static_cast<uint64_t>(std::llround(scaled));
+    return static_cast<double>(*mantissa) / kPowersOf10[decimals] == value;
+  }
+
+  static uint8_t put_number(double value, uint8_t decimals, uint8_t** out) {
+    uint64_t mantissa;
+    if (to_fixed(value, decimals, &mantissa)) {
+      *out += put_varint(mantissa, *out);
+      return kSymbolDecimals;
+    }
+    if (to_fixed(value, kMaxDecimals, &mantissa)) {
+      *out += put_varint(mantissa, *out);
+      return kMaxDecimalsMode;
+    }
+    std::memcpy(*out, &value, sizeof(value));
+    *out += sizeof(value);
+    return kDouble;
+  }
+
+  static bool get_number(uint8_t mode, uint8_t decimals, const uint8_t** in,
+                         const uint8_t* end, double* value) {
+    if (mode == kDouble) {
+      if (static_cast<size_t>(end - *in) < sizeof(*value)) {
+        return false;
+      }
+      std::memcpy(value, *in, sizeof(*value));
+      *in += sizeof(*value);
+      return true;
+    }
+    uint64_t mantissa;
+    if (mode > kDouble || !get_varint(in, end, &mantissa)) {
+      return false;
+    }
+    *value = static_cast<double>(mantissa) /
+             kPowersOf10[mode == kSymbolDecimals ? decimals : kMaxDecimals];
+    return true;
+  }
+
+  uint64_t last_trade_ids_[kNumSymbols];
+  uint64_t last_trade_time_;
+  uint32_t num_symbols_ = kNumSymbols;
+};
+
+}  // namespace opentoken
+
+#endif  // _OPENTOKEN__HARE__TRADE_ENCODING_H_
@@ -1,15 +1,58 @@
 #ifndef _OPENTOKEN__HARE__UTIL_H_
 #define _OPENTOKEN__HARE__UTIL_H_
 
+#include "check.h"
+
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include <cstdio>
+#include <cstdlib>
 #include <string>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 namespace opentoken {
 
+// Reads an unsigned integer setting from the environment, falling back to
+// |default_value| when the variable is unset or empty.
+static inline uint64_t getenv_uint(const char* name, uint64_t default_value) {
+  const char* value = getenv(name);
+  if (!value || !*value) {
+    return default_value;
+  }
+  char* end;
+  const auto result = std::strtoull(value, &end, 10);
+  CHECK(*end == '\0', "bad value for %s: \"%s\"", name, value);
+  return result;
+}
+
+static inline void pin_thread_to_cpu(uint64_t cpu) {
+#ifdef __linux__
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  CHECK_OK(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus),
+           "failed to pin to cpu %llu", static_cast<unsigned long long>(cpu));
+#else
+  (void)cpu;
+#endif
+}
+
+// Call in every round of a busy wait: the CPU backs off briefly and leaves
+// the core's resources to its hyperthread sibling.
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  _mm_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
 template <size_t N>
 std::string bin_to_hex(const uint8_t (&s)[N]) {
   constexpr auto hex = "0123456789ABCDEF";
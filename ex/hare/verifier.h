@@ -0,0 +1,139 @@
+#ifndef _OPENTOKEN__HARE__VERIFIER_H_
+#define _OPENTOKEN__HARE__VERIFIER_H_
+
+#include "check.h"
+#include "hasher.h"
+#include "message_pool.h"
+#include "network.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace opentoken {
+
+// Checks the signatures of batches of datagrams on |num_threads| threads,
+// each with its own Hasher checking a whole batch at once, while the thread
+// that read them reads on.
+// Batches may finish in any order. fd() becomes readable whenever one does,
+// so an EventLoop can wait for them along with its sockets.
+class BatchVerifier final {
+ public:
+  // Datagrams held in a UDPMessagePool until their signatures are checked.
+  struct Batch {
+    UDPMessagePool::Handle handles[UDPSocket::kMaxBatchSize];
+    UDPMessage* messages[UDPSocket::kMaxBatchSize];
+    bool valid[UDPSocket::kMaxBatchSize];
+    // Left to the caller, to note what it did with each datagram meanwhile.
+    bool peeked[UDPSocket::kMaxBatchSize];
+    size_t count = 0;
+    // Set once |valid| is filled in.
+    std::atomic<bool> done{false};
+  };
+
+  BatchVerifier(const std::string& key, size_t num_threads)
+      : event_fd_(eventfd(0, EFD_NONBLOCK)) {
+    CHECK_ERRNO(event_fd_ >= 0);
+    CHECK(num_threads > 0);
+    for (size_t i = 0; i < num_threads; ++i) {
+      threads_.emplace_back([this, key]() { run(Hasher{key}); });
+    }
+  }
+
+  ~BatchVerifier() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    queued_cv_.notify_all();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+    close(event_fd_);
+  }
+
+  int fd() const { return event_fd_; }
+
+  // Queues |batch| to have its signatures checked. It must stay alive and
+  // untouched until done.
+  void submit(Batch* batch) {
+    batch->done.store(false, std::memory_order_relaxed);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queued_.push_back(batch);
+    }
+    queued_cv_.notify_one();
+  }
+
+  // Clears fd() once it has been readable.
+  void clear_fd() {
+    uint64_t count;
+    (void)!read(event_fd_, &count, sizeof(count));
+  }
+
+ private:
+  BatchVerifier(BatchVerifier&) = delete;
+  BatchVerifier(BatchVerifier&&) = delete;
+
+  void run(Hasher hasher) {
+    while (true) {
+      Batch* batch;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        queued_cv_.wait(lock,
+                        [this]() { return stopping_ || !queued_.empty(); });
+        if (stopping_) {
+          return;
+        }
+        batch = queued_.front();
+        queued_.pop_front();
+      }
+
+      // Datagrams too short to hold a signature are left out of the batch.
+      const uint8_t* inputs[UDPSocket::kMaxBatchSize];
+      size_t sizes[UDPSocket::kMaxBatchSize];
+      const uint8_t* signatures[UDPSocket::kMaxBatchSize];
+      bool valid[UDPSocket::kMaxBatchSize];
+      size_t signed_indices[UDPSocket::kMaxBatchSize];
+      size_t num_signed = 0;
+      for (size_t i = 0; i < batch->count; ++i) {
+        const UDPMessage& message = *batch->messages[i];
+        batch->valid[i] = false;
+        if (message.size() >= kHashSizeBytes) {
+          sizes[num_signed] = message.size() - kHashSizeBytes;
+          inputs[num_signed] = message.data();
+          signatures[num_signed] = message.data() + sizes[num_signed];
+          signed_indices[num_signed++] = i;
+        }
+      }
+      hasher.are_valid_signatures(inputs, sizes, signatures, num_signed,
+                                  valid);
+      for (size_t i = 0; i < num_signed; ++i) {
+        batch->valid[signed_indices[i]] = valid[i];
+      }
+
+      batch->done.store(true, std::memory_order_release);
+      const uint64_t one = 1;
+      CHECK_ERRNO(write(event_fd_, &one, sizeof(one)) == sizeof(one));
+    }
+  }
+
+  const int event_fd_;
+  std::mutex mutex_;
+  std::condition_variable queued_cv_;
+  std::deque<Batch*> queued_;
+  bool stopping_ = false;
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace opentoken
+
+#endif  // _OPENTOKEN__HARE__VERIFIER_H_